@@ -21,17 +21,27 @@
 
 #include <fuse.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
-#ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
-#endif
 #include <sys/wait.h>
+#ifdef __linux__
+/* For the FICLONE reflink ioctl */
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#if defined(__x86_64__)
+/* For the SSE 4.2 crc32 instruction */
+#include <nmmintrin.h>
+#endif
 #include <cassert>
+#include <climits>
+#include <cstdint>
 #include <string>
 #include <iostream>
 #include <array>
@@ -43,6 +53,18 @@
 #include <iomanip>
 #include <sstream>
 #include <functional>
+#include <map>
+#include <set>
+#include <mutex>
+#include <limits>
+#include <atomic>
+#include <shared_mutex>
+#include <unordered_set>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+#include <list>
+#include <memory>
 
 using std::string;
 using std::cout;
@@ -50,6 +72,7 @@ using std::cerr;
 using std::endl;
 
 static string mirrordir;
+static string coldtierdir; // empty unless a cold tier was given at mount
 
 static const string term_red = "[0;31m";
 static const string term_yellow = "[0;33m";
@@ -57,14 +80,47 @@ static const string term_reset = "[0;0m";
 
 static int GARBAGE_INTERVAL = 5; //how often to garbage collect in seconds
 static string SNAPSHOT_DIRECTORY_NAME = ".elephant_snapshot";
+static string PACK_FILE_NAME = "pack";
+static string GENERATIONS_DIRECTORY_NAME = ".elephant_generations";
+static string TRASH_DIRECTORY_NAME = ".elephant_trash";
+static string CONTROL_FILE_NAME = ".elephant_control";
+static string TIME_TRAVEL_DIRECTORY_NAME = ".at"; // /.at/<time>/ shows the
+                                                  // tree as it was then
 static int LANDMARK_AGE = 10;//604800;  //the amount of time (in seconds) to keep all
                                    //backups, default to 7 days
 static int LANDMARK_AMOUNT = 5;   //how many version of a file to keep before
                                    //cleaning some up 
+static int TRASH_AGE = 604800;     //how long (in seconds) deleted directories
+                                   //stay in the trash, default to 7 days
+static int COLD_TIER_AGE = 86400;  //how old (in seconds) a backup has to be
+                                   //before it is moved to the cold tier
+static off_t BACKUP_QUOTA = 0;     //how many bytes all backups together may
+                                   //use, 0 for no limit
+static off_t DIRECTORY_QUOTA = 0;  //how many bytes the backups in one
+                                   //directory may use, 0 for no limit
+static off_t PACK_THRESHOLD = 64 << 10; //backups smaller than this many bytes
+                                   //go in pack files, 0 to never pack
+static off_t SCRUB_RATE = 32 << 20; //how many bytes per second the scrubber
+                                   //may read, 0 to not scrub
+static int SCRUB_INTERVAL = 86400; //how long (in seconds) to wait between
+                                   //checking every backup
+static size_t LISTING_CACHE_ENTRIES = 1 << 20; //how many names cached
+                                   //directory listings may hold in all
+static bool HIDE_SNAPSHOTS = false; //leave .elephant_snapshot directories out
+                                   //of listings
+static int RESTORE_THREADS = 0;    //how many files to restore at once, 0 for
+                                   //one per core
 
 using clk = std::chrono::system_clock;
+// Where a backup's checksum is kept, as 8 hex digits
+static const char* checksum_xattr_name = "user.elephant.crc32c";
+
 // year-month-day-hour:minutes:seconds
 static string backup_timestamp_fmt = "%Y-%m-%d-%T";
+// What the <time> in /.at/<time>/ may look like, tried in order
+static const std::array<const char*, 4> time_travel_timestamp_fmts{{
+  "%Y-%m-%dT%T", "%Y-%m-%dT%H:%M", "%Y-%m-%d-%T", "%Y-%m-%d"
+}};
 
 string parentDir = "..";
 string selfDir = ".";                           
@@ -95,7 +151,7 @@ static void copyFile(const string& from, const string& to)
   }
 }
 
-static void moveFile(const string& from, const string& to)
+static bool moveFile(const string& from, const string& to)
 {
   //// fork splits this process into two exact copies. vfork doesn't make a fully
   //// copy, but we don't care because the child process isn't going to modify
@@ -119,7 +175,231 @@ static void moveFile(const string& from, const string& to)
   //  wait(nullptr);
   //}
 
-  rename(from.c_str(), to.c_str());
+  return rename(from.c_str(), to.c_str()) == 0;
+}
+
+// Copies from to to with plain read and write calls instead of forking cp,
+// keeping the mode and timestamps. The new file is synced before returning.
+// Returns false if anything went wrong, in which case to may be half-written.
+static bool streamCopyFile(const string& from, const string& to)
+{
+  int in = open(from.c_str(), O_RDONLY);
+  if (in == -1) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(in, &st) == -1) {
+    close(in);
+    return false;
+  }
+  int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+  if (out == -1) {
+    close(in);
+    return false;
+  }
+
+  bool ok = true;
+  std::vector<char> buffer(1 << 20);
+  while (ok) {
+    ssize_t amount_read = read(in, buffer.data(), buffer.size());
+    if (amount_read <= 0) {
+      ok = amount_read == 0;
+      break;
+    }
+    // write can stop short, so keep going until the whole chunk is out
+    for (ssize_t written = 0; written < amount_read; ) {
+      ssize_t res = write(out, buffer.data() + written, amount_read - written);
+      if (res == -1) {
+        ok = false;
+        break;
+      }
+      written += res;
+    }
+  }
+
+  // Keep the owner of the original; this only works when we run as root, so
+  // a failure here isn't a reason to throw the copy away
+  fchown(out, st.st_uid, st.st_gid);
+  const struct timespec times[2] = { st.st_atim, st.st_mtim };
+  ok = ok && futimens(out, times) == 0 && fsync(out) == 0;
+  close(out);
+  close(in);
+  return ok;
+}
+
+// Like streamCopyFile, but tries a reflink first, which shares the data blocks
+// instead of copying them on filesystems that support it (btrfs, XFS)
+static bool cloneFile(const string& from, const string& to)
+{
+#ifdef FICLONE
+  int in = open(from.c_str(), O_RDONLY);
+  if (in == -1) {
+    return false;
+  }
+  struct stat st;
+  bool cloned = false;
+  if (fstat(in, &st) == 0) {
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+    if (out != -1) {
+      const struct timespec times[2] = { st.st_atim, st.st_mtim };
+      fchown(out, st.st_uid, st.st_gid);
+      cloned = ioctl(out, FICLONE, in) == 0 && futimens(out, times) == 0;
+      close(out);
+    }
+  }
+  close(in);
+  if (cloned) {
+    return true;
+  }
+#endif
+  return streamCopyFile(from, to);
+}
+
+// Makes path and any of its parents that don't exist yet, like mkdir -p
+static void makeDirectories(const string& path)
+{
+  for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)) {
+    string prefix = path.substr(0, pos);
+    int err = mkdir(prefix.c_str(), 0700);
+    if (err == -1 && errno != EEXIST) {
+      cerr << "Couldn't make " << prefix << " error was " << strerror(errno) << "(" << errno << ")" << endl;
+    }
+    if (pos == string::npos) {
+      break;
+    }
+  }
+}
+
+// CRC32C (Castagnoli), the checksum kept for every backup. x86 CPUs with SSE
+// 4.2 do it in hardware at several GB/s, so checking backups is limited by
+// the disks rather than the CPU. Everything else uses slicing-by-8 tables.
+
+static std::array<std::array<uint32_t, 256>, 8> make_crc32c_tables()
+{
+  std::array<std::array<uint32_t, 256>, 8> tables;
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+    }
+    tables[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; ++i) {
+    for (size_t t = 1; t < tables.size(); ++t) {
+      tables[t][i] = (tables[t-1][i] >> 8) ^ tables[0][tables[t-1][i] & 0xff];
+    }
+  }
+  return tables;
+}
+
+static const std::array<std::array<uint32_t, 256>, 8> crc32c_tables =
+  make_crc32c_tables();
+
+static uint32_t crc32c_scalar(uint32_t crc, const unsigned char* data,
+                              size_t length)
+{
+  const auto& t = crc32c_tables;
+  crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  for (; length >= 8; data += 8, length -= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    word ^= crc;
+    crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff]
+      ^ t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff]
+      ^ t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff]
+      ^ t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+  }
+#endif
+  for (; length > 0; ++data, --length) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xff];
+  }
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char* data,
+                             size_t length)
+{
+  uint64_t crc64 = ~crc;
+  for (; length >= 8; data += 8, length -= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  uint32_t crc32 = crc64;
+  for (; length > 0; ++data, --length) {
+    crc32 = _mm_crc32_u8(crc32, *data);
+  }
+  return ~crc32;
+}
+#endif
+
+// Continues the CRC32C crc over length more bytes of data. Start with 0.
+static uint32_t crc32c(uint32_t crc, const unsigned char* data, size_t length)
+{
+#if defined(__x86_64__)
+  static const bool have_sse42 = __builtin_cpu_supports("sse4.2");
+  if (have_sse42) {
+    return crc32c_sse42(crc, data, length);
+  }
+#endif
+  return crc32c_scalar(crc, data, length);
+}
+
+// Computes the checksum of the file at path into checksum. If rate isn't 0,
+// reads no faster than rate bytes per second. Given a length, only checks
+// that many bytes from offset. Returns false if the file couldn't be read.
+static bool checksumFile(const string& path, uint32_t* checksum, off_t rate,
+                         off_t offset = 0, off_t length = -1)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<unsigned char> buffer(1 << 20);
+  uint32_t crc = 0;
+  off_t total_read = 0;
+  ssize_t amount_read;
+  while ((amount_read = pread(fd, buffer.data(),
+            length < 0 ? buffer.size()
+              : std::min<off_t>(buffer.size(), length - total_read),
+            offset + total_read)) > 0) {
+    crc = crc32c(crc, buffer.data(), amount_read);
+    total_read += amount_read;
+    if (rate > 0) {
+      std::this_thread::sleep_until(start
+        + std::chrono::microseconds(total_read * 1000000 / rate));
+    }
+  }
+  // Keep read's errno for the caller
+  int saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  *checksum = crc;
+  return amount_read == 0;
+}
+
+// Reads the checksum recorded on a backup. Returns false if it has none.
+static bool getChecksumAttribute(const string& path, uint32_t* checksum)
+{
+  char value[9] = {};
+  if (getxattr(path.c_str(), checksum_xattr_name, value, 8) != 8) {
+    return false;
+  }
+  char* end;
+  *checksum = strtoul(value, &end, 16);
+  return end == value + 8;
+}
+
+static bool setChecksumAttribute(const string& path, uint32_t checksum)
+{
+  char value[9];
+  snprintf(value, sizeof(value), "%08x", checksum);
+  return setxattr(path.c_str(), checksum_xattr_name, value, 8, 0) == 0;
 }
 
 // Given path, return the child name (part after last /) and parent name (the
@@ -189,6 +469,10 @@ std::tuple<string, string> break_off_last_path_entry(const string& path) {
 static void directory_map(const string& dirname,
       std::function<void(const string&)> callback) {
   DIR* dir = opendir(dirname.c_str());
+  if (dir == nullptr) {
+    cerr << "Couldn't open " << dirname << " error was " << strerror(errno) << "(" << errno << ")" << endl;
+    return;
+  }
   while(true) {
     dirent entry;
     dirent* entry_ptr;
@@ -234,13 +518,25 @@ static bool keepFileEvaluation( const std::time_t& time_newest,
   }
 }
 
+// Returns the current time formatted for the start of a backup's name
+static string current_timestring() {
+  std::time_t timept_as_time_t = clk::to_time_t(clk::now());
+  std::tm* timept_as_tm = std::localtime(&timept_as_time_t);
+  std::stringstream time_stringstream;
+  time_stringstream << std::put_time(timept_as_tm, backup_timestamp_fmt.c_str());
+  return time_stringstream.str();
+}
+
 // Given a filename of a backup, return its creation time and its iteration
 // number
 std::tuple<time_t, size_t> get_time_and_iteration_from_filename
     (const string& name) {
   std::stringstream namestringstream(name);
 
-  std::tm filetime_as_tm;
+  // get_time only fills in the fields it parses, so start from zero and let
+  // mktime work out daylight saving itself
+  std::tm filetime_as_tm = {};
+  filetime_as_tm.tm_isdst = -1;
   char underscore;
   size_t currIteration;
   namestringstream
@@ -261,219 +557,2392 @@ std::tuple<time_t, size_t> get_time_and_iteration_from_filename
   return std::make_tuple(filetime_as_time_t, currIteration);
 }
 
-static void backupFile(const string& path, bool move = false) {
-  cerr << term_yellow << "Backing up " << path << term_reset << endl;
-  string containing_dir, filename;
-  std::tie(containing_dir, filename) = break_off_last_path_entry(path);
+// Directory listings. An open directory handle keeps the listing it got at
+// opendir, so the kernel paging through it by offset costs nothing extra.
+// Recent listings of backend directories are cached, up to
+// LISTING_CACHE_ENTRIES names in all, and a cached listing is used until the
+// directory's inode or mtime changes or something changes it through the
+// mount.
+
+struct DirectoryEntry {
+  string name;
+  ino_t ino;
+  mode_t mode;
+};
 
-  // Make .elephant_snapshots directory
-  std::stringstream newLocationBuilder;
-  newLocationBuilder << containing_dir << "/" << SNAPSHOT_DIRECTORY_NAME;
-  cerr << "Making" << newLocationBuilder.str() << endl;
-  int err = mkdir( newLocationBuilder.str().c_str(), 0700);
-  // If we got an error that's not a "file already exists" error
-  if (err == -1 && errno != EEXIST) {
-    cerr << "Couldn't make " << newLocationBuilder.str() << " error was " << strerror(errno) << "(" << errno << ")" << endl;
+struct DirectoryListing {
+  ino_t ino;
+  struct timespec mtime;
+  std::vector<DirectoryEntry> entries;
+};
+
+static std::mutex listing_cache_mutex;
+// Most recently used first, keyed by backend directory
+static std::list<std::pair<string, std::shared_ptr<const DirectoryListing>>>
+  listing_cache;
+static std::unordered_map<string, decltype(listing_cache)::iterator>
+  listing_cache_index;
+static size_t listing_cache_entries = 0;
+// Bumped on every change, so a listing read while something changed the
+// directory never makes it into the cache
+static size_t listing_cache_changes = 0;
+
+// Must hold listing_cache_mutex
+static void forget_listing_locked(const string& dir) {
+  auto index_it = listing_cache_index.find(dir);
+  if (index_it == listing_cache_index.end()) {
+    return;
   }
+  listing_cache_entries -= index_it->second->second->entries.size();
+  listing_cache.erase(index_it->second);
+  listing_cache_index.erase(index_it);
+}
 
-  // Make .snapshots/thefile directory
-  newLocationBuilder << "/" << filename;
-  cerr << "Making" << newLocationBuilder.str() << endl;
-  err = mkdir( newLocationBuilder.str().c_str(), 0700);
-  // If we got an error that's not a "file already exists" error
-  if (err == -1 && errno != EEXIST) {
-    cerr << "Couldn't make " << newLocationBuilder.str() << " error was " << strerror(errno) << "(" << errno << ")" << endl;
+// Call whenever the entries of the backend directory dir change
+static void forget_listing(const string& dir) {
+  std::lock_guard<std::mutex> lock(listing_cache_mutex);
+  ++listing_cache_changes;
+  forget_listing_locked(dir);
+}
+
+// Call whenever the file at path appears, disappears or is renamed
+static void forget_parent_listing(const string& path) {
+  string containing_dir;
+  std::tie(containing_dir, std::ignore) = break_off_last_path_entry(path);
+  forget_listing(containing_dir);
+}
+
+// Things we keep in the backend but that don't need to show up in listings
+// with --hide-snapshots. They can still be looked up by name.
+static bool hidden_from_listing(const string& dir, const string& name) {
+  return HIDE_SNAPSHOTS && (name == SNAPSHOT_DIRECTORY_NAME
+    || (dir == mirrordir && (name == GENERATIONS_DIRECTORY_NAME
+                             || name == TRASH_DIRECTORY_NAME)));
+}
+
+// Returns the listing of the backend directory dir, or nullptr with errno set
+static std::shared_ptr<const DirectoryListing> get_listing(string dir) {
+  // The mount's root comes in as mirrordir + "/"
+  if (dir.size() > 1 && dir.back() == '/') {
+    dir.pop_back();
+  }
+  size_t changes;
+  {
+    std::lock_guard<std::mutex> lock(listing_cache_mutex);
+    changes = listing_cache_changes;
+  }
+  // stat before reading, so that a change while reading shows up as a
+  // different mtime next time
+  struct stat st;
+  if (stat(dir.c_str(), &st) == -1) {
+    return nullptr;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    errno = ENOTDIR;
+    return nullptr;
+  }
+  {
+    std::lock_guard<std::mutex> lock(listing_cache_mutex);
+    auto index_it = listing_cache_index.find(dir);
+    if (index_it != listing_cache_index.end()) {
+      const auto& cached = index_it->second->second;
+      if (cached->ino == st.st_ino && cached->mtime.tv_sec == st.st_mtim.tv_sec
+          && cached->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        listing_cache.splice(listing_cache.begin(), listing_cache, index_it->second);
+        return cached;
+      }
+      forget_listing_locked(dir);
+    }
   }
 
-  // Get the current time in the right format
-  std::time_t timept_as_time_t = clk::to_time_t(clk::now());
-  std::tm* timept_as_tm = std::localtime(&timept_as_time_t);
-  std::stringstream time_stringstream;
-  time_stringstream << std::put_time(timept_as_tm, backup_timestamp_fmt.c_str());
-  string timestring = time_stringstream.str();
+  DIR *dp = opendir(dir.c_str());
+  if (dp == NULL) {
+    return nullptr;
+  }
+  auto listing = std::make_shared<DirectoryListing>();
+  listing->ino = st.st_ino;
+  listing->mtime = st.st_mtim;
+  struct dirent *de;
+  while ((de = readdir(dp)) != NULL) {
+    if (hidden_from_listing(dir, de->d_name)) {
+      continue;
+    }
+    listing->entries.push_back({de->d_name, de->d_ino,
+                                static_cast<mode_t>(de->d_type << 12)});
+  }
+  closedir(dp);
 
-  // Get the largest revision number in the directory
-  size_t largest_previous_revision_number = 0;
-  directory_map(newLocationBuilder.str(),
-    [&largest_previous_revision_number](const string& backup_name) {
-      size_t revision_number;
-      cerr << term_yellow << "Calling parse from backupFile" << term_reset << endl;
-      std::tie(std::ignore, revision_number) =
-        get_time_and_iteration_from_filename(backup_name);
+  std::lock_guard<std::mutex> lock(listing_cache_mutex);
+  if (changes == listing_cache_changes
+      && listing->entries.size() <= LISTING_CACHE_ENTRIES) {
+    forget_listing_locked(dir);
+    listing_cache.emplace_front(dir, listing);
+    listing_cache_index[dir] = listing_cache.begin();
+    listing_cache_entries += listing->entries.size();
+    while (listing_cache_entries > LISTING_CACHE_ENTRIES) {
+      forget_listing_locked(listing_cache.back().first);
+    }
+  }
+  return listing;
+}
+
+// Everything we know about the backups that exist, kept up to date as
+// backupFile makes them and removeBackup deletes them, so that nobody has to
+// walk the tree to find out how much space they use or what to prune next.
+
+// (time, iteration) of a backup, which orders a file's backups oldest first
+using BackupKey = std::pair<time_t, size_t>;
+
+struct BackupInfo {
+  string name;  // filename inside the file's backup directory
+  off_t bytes;
+  bool has_checksum;
+  uint32_t checksum;
+  // Small backups live in their directory's pack file instead of a file of
+  // their own. For those, these say where they are and what the file looked
+  // like; pack_offset is -1 for everything else.
+  size_t pack_number;
+  off_t pack_offset;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  std::time_t mtime;
+};
+
+// All the backups of one file, which live in <dir>/.elephant_snapshot/<file>
+struct BackedUpFile {
+  std::map<BackupKey, BackupInfo> backups;
+  off_t bytes = 0;
+  size_t largest_iteration = 0;
+};
+
+// A backup that quota enforcement is allowed to delete: (time, iteration,
+// backup directory). Sets of these sort the least valuable, oldest, first.
+using PruneCandidate = std::tuple<time_t, size_t, string>;
+
+// Totals for one .elephant_snapshot directory
+struct SnapshotDirectoryUsage {
+  off_t bytes = 0;
+  std::set<PruneCandidate> prunable;
+};
+
+static std::mutex catalog_mutex;
+// Keyed by backup directory, <dir>/.elephant_snapshot/<file>
+static std::map<string, BackedUpFile> backup_catalog;
+// Keyed by .elephant_snapshot directory
+static std::map<string, SnapshotDirectoryUsage> snapshot_directory_usage;
+static std::set<PruneCandidate> prunable_backups;
+static off_t total_backup_bytes = 0;
+
+// Adds or takes away a backup from the ones quota enforcement may delete.
+// Must be called with catalog_mutex held.
+static void set_prunable(const string& backup_dir, const BackupKey& key,
+                         bool prunable) {
+  string snapshot_dir;
+  std::tie(snapshot_dir, std::ignore) = break_off_last_path_entry(backup_dir);
+  std::set<PruneCandidate>& directory_prunable =
+    snapshot_directory_usage[snapshot_dir].prunable;
+
+  PruneCandidate candidate(key.first, key.second, backup_dir);
+  if (prunable) {
+    prunable_backups.insert(candidate);
+    directory_prunable.insert(candidate);
+  } else {
+    prunable_backups.erase(candidate);
+    directory_prunable.erase(candidate);
+  }
+}
+
+// Records a backup in backup_dir and returns its key
+static BackupKey catalog_add(const string& backup_dir, const BackupInfo& info) {
+  BackupKey key;
+  std::tie(key.first, key.second) =
+    get_time_and_iteration_from_filename(info.name);
+  string snapshot_dir;
+  std::tie(snapshot_dir, std::ignore) = break_off_last_path_entry(backup_dir);
+
+  std::lock_guard<std::mutex> lock(catalog_mutex);
+  BackedUpFile& file = backup_catalog[backup_dir];
+  if (file.backups.count(key) != 0) {
+    return key;
+  }
+
+  // The newest backup of a file is never pruned for quota, only the older
+  // ones
+  if (!file.backups.empty()) {
+    const BackupKey& newest = file.backups.rbegin()->first;
+    set_prunable(backup_dir, newest < key ? newest : key, true);
+  }
+
+  file.backups.emplace(key, info);
+  file.bytes += info.bytes;
+  file.largest_iteration = std::max(file.largest_iteration, key.second);
+  snapshot_directory_usage[snapshot_dir].bytes += info.bytes;
+  total_backup_bytes += info.bytes;
+  return key;
+}
+
+// Forgets the backup with the given key in backup_dir
+static void catalog_remove(const string& backup_dir, const BackupKey& key) {
+  string snapshot_dir;
+  std::tie(snapshot_dir, std::ignore) = break_off_last_path_entry(backup_dir);
+
+  std::lock_guard<std::mutex> lock(catalog_mutex);
+  auto file_it = backup_catalog.find(backup_dir);
+  if (file_it == backup_catalog.end()) {
+    return;
+  }
+  BackedUpFile& file = file_it->second;
+  auto backup_it = file.backups.find(key);
+  if (backup_it == file.backups.end()) {
+    return;
+  }
+
+  off_t bytes = backup_it->second.bytes;
+  set_prunable(backup_dir, key, false);
+  file.backups.erase(backup_it);
+  file.bytes -= bytes;
+  total_backup_bytes -= bytes;
+
+  SnapshotDirectoryUsage& usage = snapshot_directory_usage[snapshot_dir];
+  usage.bytes -= bytes;
+
+  if (file.backups.empty()) {
+    backup_catalog.erase(file_it);
+  } else {
+    // Whatever is newest now is protected again
+    set_prunable(backup_dir, file.backups.rbegin()->first, false);
+  }
+  if (usage.bytes == 0 && usage.prunable.empty()) {
+    snapshot_directory_usage.erase(snapshot_dir);
+  }
+}
+
+// Pack files. Backups smaller than PACK_THRESHOLD are appended to
+// .elephant_snapshot/.elephant_snapshot/pack_<n> instead of getting a
+// directory and a file each, which saves a couple of inodes and directory
+// entries per backup. Every other name in .elephant_snapshot is the backup
+// directory of a file next to it, and no file can be called
+// .elephant_snapshot there, so that's the one name that's free for packs.
+// pack_index next to the pack is a log of what was added to and deleted
+// from the pack. Once at least half of a pack is deleted, the GC
+// writes out a new one with just the live backups and switches to it by
+// renaming a new index into place.
+
+// One entry in a pack index, followed by the file name and the backup name
+struct PackIndexRecord {
+  char type;        // 'h' for the header, 'a' for added, 'd' for deleted
+  char unused[3];
+  uint32_t checksum;
+  uint64_t offset;  // where the backup starts, or the pack number for 'h'
+  uint64_t length;
+  int64_t mtime;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint16_t file_name_length;
+  uint16_t backup_name_length;
+};
+
+// The state of one .elephant_snapshot directory's pack
+struct PackUsage {
+  size_t number = 1;
+  off_t live_bytes = 0;
+  off_t dead_bytes = 0;
+};
+
+// Taken before catalog_mutex whenever both are needed
+static std::mutex pack_mutex;
+// Keyed by .elephant_snapshot directory
+static std::map<string, PackUsage> packs;
+
+static bool is_pack_file_name(const string& name) {
+  return name.compare(0, PACK_FILE_NAME.size(), PACK_FILE_NAME) == 0;
+}
+
+static string pack_directory(const string& snapshot_dir) {
+  return snapshot_dir + "/" + SNAPSHOT_DIRECTORY_NAME;
+}
+
+static string pack_file_path(const string& snapshot_dir, size_t number) {
+  return pack_directory(snapshot_dir) + "/" + PACK_FILE_NAME + "_"
+    + std::to_string(number);
+}
+
+static string pack_index_path(const string& snapshot_dir) {
+  return pack_directory(snapshot_dir) + "/" + PACK_FILE_NAME + "_index";
+}
+
+// Appends a record to the pack index in fd
+static bool write_pack_record(int fd, PackIndexRecord record,
+                              const string& file_name,
+                              const string& backup_name) {
+  record.file_name_length = file_name.size();
+  record.backup_name_length = backup_name.size();
+  string buffer(reinterpret_cast<const char*>(&record), sizeof(record));
+  buffer += file_name;
+  buffer += backup_name;
+  return write(fd, buffer.data(), buffer.size())
+    == static_cast<ssize_t>(buffer.size());
+}
+
+// Starts a new index for snapshot_dir's pack number. Must hold pack_mutex.
+static int create_pack_index(const string& index_path, size_t number) {
+  int fd = open(index_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    return -1;
+  }
+  PackIndexRecord header = {};
+  header.type = 'h';
+  header.offset = number;
+  if (!write_pack_record(fd, header, "", "")) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Opens snapshot_dir's pack index for appending, starting it if there isn't
+// one yet. Must hold pack_mutex.
+static int open_pack_index(const string& snapshot_dir) {
+  string index_path = pack_index_path(snapshot_dir);
+  int fd = open(index_path.c_str(), O_WRONLY | O_APPEND);
+  if (fd == -1 && errno == ENOENT) {
+    fd = create_pack_index(index_path, packs[snapshot_dir].number);
+  }
+  return fd;
+}
+
+// Puts the contents of the file at path into its directory's pack as a backup
+// called backup_name, removing the file afterwards if move is set. Returns
+// false if the backup has to be made the normal way instead.
+static bool packBackup(const string& path, const string& snapshot_dir,
+                       const string& filename, const string& backup_name,
+                       bool move) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat st;
+  std::vector<unsigned char> contents;
+  bool ok = fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+    && st.st_size < PACK_THRESHOLD;
+  if (ok) {
+    contents.resize(st.st_size);
+    for (off_t total_read = 0; ok && total_read < st.st_size; ) {
+      ssize_t amount_read = pread(fd, contents.data() + total_read,
+                                  st.st_size - total_read, total_read);
+      ok = amount_read > 0;
+      total_read += amount_read;
+    }
+  }
+  close(fd);
+  if (!ok) {
+    return false;
+  }
+
+  BackupInfo info;
+  info.name = backup_name;
+  info.bytes = contents.size();
+  info.has_checksum = true;
+  info.checksum = crc32c(0, contents.data(), contents.size());
+  info.mode = st.st_mode & 07777;
+  info.uid = st.st_uid;
+  info.gid = st.st_gid;
+  info.mtime = st.st_mtime;
+
+  std::lock_guard<std::mutex> lock(pack_mutex);
+  PackUsage& pack = packs[snapshot_dir];
+  makeDirectories(pack_directory(snapshot_dir));
+  int index_fd = open_pack_index(snapshot_dir);
+  int pack_fd = open(pack_file_path(snapshot_dir, pack.number).c_str(),
+                     O_WRONLY | O_CREAT | O_APPEND, 0600);
+  struct stat pack_st;
+  ok = index_fd != -1 && pack_fd != -1 && fstat(pack_fd, &pack_st) == 0
+    && write(pack_fd, contents.data(), contents.size())
+      == static_cast<ssize_t>(contents.size());
+  // When the original is going away, the pack has to be on disk first
+  ok = ok && (!move || fdatasync(pack_fd) == 0);
+  if (ok) {
+    PackIndexRecord record = {};
+    record.type = 'a';
+    record.checksum = info.checksum;
+    record.offset = pack_st.st_size;
+    record.length = info.bytes;
+    record.mtime = info.mtime;
+    record.mode = info.mode;
+    record.uid = info.uid;
+    record.gid = info.gid;
+    ok = write_pack_record(index_fd, record, filename, backup_name)
+      && (!move || fdatasync(index_fd) == 0);
+  }
+  if (pack_fd != -1) {
+    close(pack_fd);
+  }
+  if (index_fd != -1) {
+    close(index_fd);
+  }
+  if (!ok) {
+    cerr << term_red << "Couldn't add " << path << " to the pack in "
+      << snapshot_dir << term_reset << endl;
+    return false;
+  }
+
+  info.pack_number = pack.number;
+  info.pack_offset = pack_st.st_size;
+  pack.live_bytes += info.bytes;
+  catalog_add(snapshot_dir + "/" + filename, info);
+  if (move) {
+    unlink(path.c_str());
+  }
+  return true;
+}
+
+// Deletes a packed backup. Its space comes back when the pack is compacted.
+static void unpackBackup(const string& backup_dir, const BackupKey& key,
+                         const BackupInfo& info) {
+  string snapshot_dir, filename;
+  std::tie(snapshot_dir, filename) = break_off_last_path_entry(backup_dir);
+
+  std::lock_guard<std::mutex> lock(pack_mutex);
+  // Someone else may have deleted it between looking it up and here, and it
+  // mustn't be counted as deleted twice
+  {
+    std::lock_guard<std::mutex> catalog_lock(catalog_mutex);
+    auto file_it = backup_catalog.find(backup_dir);
+    if (file_it == backup_catalog.end()
+        || file_it->second.backups.count(key) == 0) {
+      return;
+    }
+  }
+
+  int index_fd = open_pack_index(snapshot_dir);
+  PackIndexRecord record = {};
+  record.type = 'd';
+  if (index_fd == -1 || !write_pack_record(index_fd, record, filename, info.name)) {
+    cerr << term_red << "Couldn't delete " << backup_dir << "/" << info.name
+      << " from its pack" << term_reset << endl;
+  }
+  if (index_fd != -1) {
+    close(index_fd);
+  }
+
+  PackUsage& pack = packs[snapshot_dir];
+  pack.live_bytes -= info.bytes;
+  pack.dead_bytes += info.bytes;
+  // Still holding pack_mutex, so compaction can't see it half-deleted
+  catalog_remove(backup_dir, key);
+}
+
+// Reads snapshot_dir's pack index at mount and puts the live backups in the
+// catalog
+static void load_pack(const string& snapshot_dir) {
+  string index_path = pack_index_path(snapshot_dir);
+  int fd = open(index_path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return;
+  }
+  string index;
+  char buffer[1 << 16];
+  ssize_t amount_read;
+  while ((amount_read = read(fd, buffer, sizeof(buffer))) > 0) {
+    index.append(buffer, amount_read);
+  }
+  close(fd);
+
+  // Replay the log. A record cut short by a crash ends it.
+  PackUsage usage;
+  std::map<std::pair<string, string>, PackIndexRecord> live;
+  size_t complete_end = 0;
+  for (size_t pos = 0; pos + sizeof(PackIndexRecord) <= index.size(); ) {
+    PackIndexRecord record;
+    memcpy(&record, index.data() + pos, sizeof(record));
+    size_t names_pos = pos + sizeof(record);
+    pos = names_pos + record.file_name_length + record.backup_name_length;
+    if (pos > index.size()) {
+      break;
+    }
+    complete_end = pos;
+    std::pair<string, string> names(
+      index.substr(names_pos, record.file_name_length),
+      index.substr(names_pos + record.file_name_length, record.backup_name_length));
+
+    if (record.type == 'h') {
+      usage.number = record.offset;
+    } else if (record.type == 'a') {
+      live[names] = record;
+    } else if (record.type == 'd') {
+      live.erase(names);
+    }
+  }
+  // Cut the torn record off, or the next append would land after it
+  if (complete_end < index.size()) {
+    cerr << term_yellow << "Dropping a torn record from the end of "
+      << index_path << term_reset << endl;
+    if (complete_end == 0) {
+      // Not even the header made it, so nothing was ever added to it
+      unlink(index_path.c_str());
+    } else if (truncate(index_path.c_str(), complete_end) == -1) {
+      cerr << term_red << "Couldn't truncate " << index_path << ": "
+        << strerror(errno) << term_reset << endl;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(pack_mutex);
+  for (const auto& entry : live) {
+    BackupInfo info;
+    info.name = entry.first.second;
+    info.bytes = entry.second.length;
+    info.has_checksum = true;
+    info.checksum = entry.second.checksum;
+    info.pack_number = usage.number;
+    info.pack_offset = entry.second.offset;
+    info.mode = entry.second.mode;
+    info.uid = entry.second.uid;
+    info.gid = entry.second.gid;
+    info.mtime = entry.second.mtime;
+    catalog_add(snapshot_dir + "/" + entry.first.first, info);
+    usage.live_bytes += info.bytes;
+  }
+
+  struct stat st;
+  string current_pack = pack_file_path(snapshot_dir, usage.number);
+  if (stat(current_pack.c_str(), &st) == 0) {
+    usage.dead_bytes = st.st_size - usage.live_bytes;
+  }
+  packs[snapshot_dir] = usage;
+
+  // Anything else is left over from a compaction that didn't finish
+  string pack_dir = pack_directory(snapshot_dir);
+  directory_map(pack_dir, [&pack_dir, &current_pack, &index_path](const string& name) {
+    string path = pack_dir + "/" + name;
+    struct stat st;
+    if (is_pack_file_name(name) && path != current_pack && path != index_path
+        && lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+      unlink(path.c_str());
+    }
+  });
+}
+
+// Rewrites snapshot_dir's pack without its deleted backups, if at least half
+// of it is deleted. The new pack gets the next number and a new index, and
+// renaming that index into place is what switches over to it, so a crash at
+// any point leaves one consistent pack or the other.
+static void compact_pack(const string& snapshot_dir) {
+  std::lock_guard<std::mutex> lock(pack_mutex);
+  auto pack_it = packs.find(snapshot_dir);
+  if (pack_it == packs.end() || pack_it->second.dead_bytes == 0
+      || pack_it->second.dead_bytes < pack_it->second.live_bytes) {
+    return;
+  }
+  PackUsage& pack = pack_it->second;
+  string old_pack_path = pack_file_path(snapshot_dir, pack.number);
+  string new_pack_path = pack_file_path(snapshot_dir, pack.number + 1);
+  string index_path = pack_index_path(snapshot_dir);
+  string new_index_path = index_path + "_compacting";
+  cerr << term_yellow << "Compacting " << old_pack_path << ", "
+    << pack.dead_bytes << " of " << pack.live_bytes + pack.dead_bytes
+    << " bytes are deleted" << term_reset << endl;
+
+  // Everything still live, (backup dir, key, info)
+  std::vector<std::tuple<string, BackupKey, BackupInfo>> live;
+  {
+    std::lock_guard<std::mutex> catalog_lock(catalog_mutex);
+    const string prefix = snapshot_dir + "/";
+    for (auto file_it = backup_catalog.lower_bound(prefix);
+         file_it != backup_catalog.end()
+           && file_it->first.compare(0, prefix.size(), prefix) == 0;
+         ++file_it) {
+      // Backups of backups further down are in a pack of their own
+      if (file_it->first.find('/', prefix.size()) != string::npos) {
+        continue;
+      }
+      for (const auto& backup : file_it->second.backups) {
+        if (backup.second.pack_offset >= 0) {
+          live.emplace_back(file_it->first, backup.first, backup.second);
+        }
+      }
+    }
+  }
+
+  int old_fd = open(old_pack_path.c_str(), O_RDONLY);
+  int new_fd = open(new_pack_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  int index_fd = create_pack_index(new_index_path, pack.number + 1);
+  bool ok = old_fd != -1 && new_fd != -1 && index_fd != -1;
+  off_t new_offset = 0;
+  std::vector<char> contents;
+  for (auto& entry : live) {
+    if (!ok) {
+      break;
+    }
+    BackupInfo& info = std::get<2>(entry);
+    contents.resize(info.bytes);
+    ok = pread(old_fd, contents.data(), info.bytes, info.pack_offset) == info.bytes
+      && write(new_fd, contents.data(), info.bytes) == info.bytes;
+
+    string filename;
+    std::tie(std::ignore, filename) = break_off_last_path_entry(std::get<0>(entry));
+    PackIndexRecord record = {};
+    record.type = 'a';
+    record.checksum = info.checksum;
+    record.offset = new_offset;
+    record.length = info.bytes;
+    record.mtime = info.mtime;
+    record.mode = info.mode;
+    record.uid = info.uid;
+    record.gid = info.gid;
+    ok = ok && write_pack_record(index_fd, record, filename, info.name);
+    info.pack_offset = new_offset;
+    new_offset += info.bytes;
+  }
+  ok = ok && fdatasync(new_fd) == 0 && fdatasync(index_fd) == 0;
+  if (old_fd != -1) {
+    close(old_fd);
+  }
+  if (new_fd != -1) {
+    close(new_fd);
+  }
+  if (index_fd != -1) {
+    close(index_fd);
+  }
+  if (!ok || rename(new_index_path.c_str(), index_path.c_str()) == -1) {
+    cerr << term_red << "Couldn't compact " << old_pack_path << term_reset << endl;
+    unlink(new_pack_path.c_str());
+    unlink(new_index_path.c_str());
+    return;
+  }
+
+  ++pack.number;
+  pack.dead_bytes = 0;
+  {
+    std::lock_guard<std::mutex> catalog_lock(catalog_mutex);
+    for (const auto& entry : live) {
+      BackupInfo& info = backup_catalog.at(std::get<0>(entry))
+        .backups.at(std::get<1>(entry));
+      info.pack_number = pack.number;
+      info.pack_offset = std::get<2>(entry).pack_offset;
+    }
+  }
+  unlink(old_pack_path.c_str());
+  if (live.empty()) {
+    unlink(new_pack_path.c_str());
+    unlink(index_path.c_str());
+    // Stays if there are backups of backups in it too
+    rmdir(pack_directory(snapshot_dir).c_str());
+    packs.erase(pack_it);
+  }
+}
+
+// Moves the catalog entries of every backup under the backend directory
+// from_dir over to to_dir, once from_dir has been renamed to to_dir
+static void catalog_move_tree(const string& from_dir, const string& to_dir) {
+  const string prefix = from_dir + "/";
+  auto in_tree = [&prefix](const string& path) {
+    return path.compare(0, prefix.size(), prefix) == 0;
+  };
+  auto moved_path = [&from_dir, &to_dir](const string& path) {
+    return to_dir + path.substr(from_dir.size());
+  };
+
+  std::lock_guard<std::mutex> pack_lock(pack_mutex);
+  std::vector<std::pair<string, PackUsage>> moved_packs;
+  for (auto pack_it = packs.lower_bound(prefix);
+       pack_it != packs.end() && in_tree(pack_it->first); ) {
+    moved_packs.emplace_back(moved_path(pack_it->first), pack_it->second);
+    pack_it = packs.erase(pack_it);
+  }
+  packs.insert(moved_packs.begin(), moved_packs.end());
+
+  std::lock_guard<std::mutex> lock(catalog_mutex);
+  std::vector<string> backup_dirs;
+  for (auto file_it = backup_catalog.lower_bound(prefix);
+       file_it != backup_catalog.end() && in_tree(file_it->first); ++file_it) {
+    backup_dirs.push_back(file_it->first);
+  }
+  for (const string& backup_dir : backup_dirs) {
+    string new_backup_dir = moved_path(backup_dir);
+    string snapshot_dir, new_snapshot_dir;
+    std::tie(snapshot_dir, std::ignore) = break_off_last_path_entry(backup_dir);
+    std::tie(new_snapshot_dir, std::ignore) = break_off_last_path_entry(new_backup_dir);
+
+    auto file_it = backup_catalog.find(backup_dir);
+    BackedUpFile file = std::move(file_it->second);
+    backup_catalog.erase(file_it);
+    for (const auto& backup : file.backups) {
+      set_prunable(backup_dir, backup.first, false);
+    }
+    SnapshotDirectoryUsage& usage = snapshot_directory_usage[snapshot_dir];
+    usage.bytes -= file.bytes;
+    if (usage.bytes == 0 && usage.prunable.empty()) {
+      snapshot_directory_usage.erase(snapshot_dir);
+    }
+
+    // Everything but the newest stays prunable
+    for (auto backup_it = file.backups.begin();
+         backup_it != file.backups.end()
+           && std::next(backup_it) != file.backups.end(); ++backup_it) {
+      set_prunable(new_backup_dir, backup_it->first, true);
+    }
+    snapshot_directory_usage[new_snapshot_dir].bytes += file.bytes;
+    backup_catalog[new_backup_dir] = std::move(file);
+  }
+}
+
+// Walks the backend directory once at mount and records the backups that are
+// already there
+static void load_backup_catalog(const string& current_directory) {
+  directory_map(current_directory, [&current_directory](const string& dirname) {
+    string full_path = current_directory + "/" + dirname;
+    struct stat st;
+    if (lstat(full_path.c_str(), &st) == -1 || !S_ISDIR(st.st_mode)
+        || dirname == GENERATIONS_DIRECTORY_NAME) {
+      return;
+    }
+
+    if (dirname != SNAPSHOT_DIRECTORY_NAME) {
+      load_backup_catalog(full_path);
+      return;
+    }
+
+    load_pack(full_path);
+    directory_map(full_path, [&full_path](const string& backup_dir_name) {
+      // That's where the packs are
+      if (backup_dir_name == SNAPSHOT_DIRECTORY_NAME) {
+        return;
+      }
+      string backup_dir = full_path + "/" + backup_dir_name;
+      directory_map(backup_dir, [&backup_dir](const string& backup_name) {
+        struct stat backup_st;
+        // stat rather than lstat so cold tier backups count their real size
+        string backup_path = backup_dir + "/" + backup_name;
+        if (stat(backup_path.c_str(), &backup_st) == 0) {
+          BackupInfo info = {};
+          info.name = backup_name;
+          info.bytes = backup_st.st_size;
+          info.has_checksum = getChecksumAttribute(backup_path, &info.checksum);
+          info.pack_offset = -1;
+          catalog_add(backup_dir, info);
+        }
+      });
+    });
+  });
+}
+
+// If backup_path is a symlink left behind by moving a backup to the cold
+// tier, returns where the backup really is. Otherwise returns backup_path.
+static string follow_cold_tier_link(const string& backup_path) {
+  if (!coldtierdir.empty()) {
+    char target[PATH_MAX];
+    ssize_t len = readlink(backup_path.c_str(), target, sizeof(target) - 1);
+    if (len != -1) {
+      target[len] = '\0';
+      if (string(target).compare(0, coldtierdir.size(), coldtierdir) == 0) {
+        return string(target);
+      }
+    }
+  }
+  return backup_path;
+}
+
+// Deletes a backup. If it has been moved to the cold tier, the hot tier only
+// holds a symlink to it, so the cold copy has to go too.
+static void removeBackup(const string& backup_path) {
+  string backup_dir, backup_name;
+  std::tie(backup_dir, backup_name) = break_off_last_path_entry(backup_path);
+  BackupKey key;
+  std::tie(key.first, key.second) =
+    get_time_and_iteration_from_filename(backup_name);
+
+  // Packed backups aren't files of their own
+  BackupInfo info;
+  bool packed = false;
+  {
+    std::lock_guard<std::mutex> lock(catalog_mutex);
+    auto file_it = backup_catalog.find(backup_dir);
+    if (file_it != backup_catalog.end()) {
+      auto backup_it = file_it->second.backups.find(key);
+      if (backup_it != file_it->second.backups.end()) {
+        info = backup_it->second;
+        packed = info.pack_offset >= 0;
+      }
+    }
+  }
+  if (packed) {
+    unpackBackup(backup_dir, key, info);
+    return;
+  }
+
+  string cold_path = follow_cold_tier_link(backup_path);
+  if (cold_path != backup_path) {
+    unlink(cold_path.c_str());
+  }
+  unlink(backup_path.c_str());
+  catalog_remove(backup_dir, key);
+}
+
+// Deletes the oldest backups that aren't the newest backup of their file until
+// all backups fit in BACKUP_QUOTA and the ones in snapshot_dir fit in
+// DIRECTORY_QUOTA, or the ones in every directory if snapshot_dir is empty.
+// The candidates are kept sorted, so this only ever looks at the backups it
+// removes.
+static void enforce_quotas(const string& snapshot_dir) {
+  if (snapshot_dir.empty() && DIRECTORY_QUOTA > 0) {
+    std::vector<string> over_quota;
+    {
+      std::lock_guard<std::mutex> lock(catalog_mutex);
+      for (const auto& usage : snapshot_directory_usage) {
+        if (usage.second.bytes > DIRECTORY_QUOTA) {
+          over_quota.push_back(usage.first);
+        }
+      }
+    }
+    for (const string& over_quota_dir : over_quota) {
+      enforce_quotas(over_quota_dir);
+    }
+  }
+
+  while (true) {
+    string victim;
+    {
+      std::lock_guard<std::mutex> lock(catalog_mutex);
+      const std::set<PruneCandidate>* candidates = nullptr;
+      if (BACKUP_QUOTA > 0 && total_backup_bytes > BACKUP_QUOTA) {
+        candidates = &prunable_backups;
+      } else if (DIRECTORY_QUOTA > 0 && !snapshot_dir.empty()) {
+        auto usage_it = snapshot_directory_usage.find(snapshot_dir);
+        if (usage_it != snapshot_directory_usage.end()
+            && usage_it->second.bytes > DIRECTORY_QUOTA) {
+          candidates = &usage_it->second.prunable;
+        }
+      }
+      if (candidates == nullptr || candidates->empty()) {
+        break;
+      }
+
+      const PruneCandidate& oldest = *candidates->begin();
+      const string& backup_dir = std::get<2>(oldest);
+      const BackupKey key(std::get<0>(oldest), std::get<1>(oldest));
+      victim = backup_dir + "/" + backup_catalog.at(backup_dir).backups.at(key).name;
+    }
+
+    cerr << term_yellow << "Over quota, pruning " << victim << term_reset << endl;
+    removeBackup(victim);
+  }
+}
+
+// Backups that were made without a checksum, for the scrubber to get to
+// right away instead of on its next pass through everything
+static std::mutex scrub_queue_mutex;
+static std::condition_variable scrub_queue_ready;
+static std::deque<std::pair<string, BackupKey>> scrub_queue;
+
+// Backs up the file at path, moving it rather than copying it if move is set.
+// A moved small file only goes into the pack if pack_move is set too, since
+// that costs a couple of fdatasyncs where the move is just a rename.
+// Returns 0, or -errno if the backup couldn't be made.
+static int backupFile(const string& path, bool move = false,
+                      bool pack_move = false) {
+  cerr << term_yellow << "Backing up " << path << term_reset << endl;
+  string containing_dir, filename;
+  std::tie(containing_dir, filename) = break_off_last_path_entry(path);
+
+  // Make .elephant_snapshots directory
+  std::stringstream newLocationBuilder;
+  newLocationBuilder << containing_dir << "/" << SNAPSHOT_DIRECTORY_NAME;
+  cerr << "Making" << newLocationBuilder.str() << endl;
+  int err = mkdir( newLocationBuilder.str().c_str(), 0700);
+  // If we got an error that's not a "file already exists" error
+  if (err == -1 && errno != EEXIST) {
+    cerr << "Couldn't make " << newLocationBuilder.str() << " error was " << strerror(errno) << "(" << errno << ")" << endl;
+  }
+  if (err == 0 && !HIDE_SNAPSHOTS) {
+    forget_listing(containing_dir);
+  }
+
+  string snapshot_dir = newLocationBuilder.str();
+  newLocationBuilder << "/" << filename;
+  string backup_dir = newLocationBuilder.str();
+
+  // Get the current time in the right format
+  string timestring = current_timestring();
+
+  // Get the largest revision number in the directory
+  size_t largest_previous_revision_number = 0;
+  {
+    std::lock_guard<std::mutex> lock(catalog_mutex);
+    auto file_it = backup_catalog.find(backup_dir);
+    if (file_it != backup_catalog.end()) {
+      largest_previous_revision_number = file_it->second.largest_iteration;
+    }
+  }
+
+  std::stringstream backup_name_builder;
+  backup_name_builder << timestring << "_" << largest_previous_revision_number+1;
+  string backup_name = backup_name_builder.str();
+
+  // Small files go in the pack rather than .snapshots/thefile/thetime
+  struct stat st;
+  if (PACK_THRESHOLD > 0 && (!move || pack_move)
+      && lstat(path.c_str(), &st) == 0
+      && S_ISREG(st.st_mode) && st.st_size < PACK_THRESHOLD
+      && packBackup(path, snapshot_dir, filename, backup_name, move)) {
+    enforce_quotas(snapshot_dir);
+    return 0;
+  }
+
+  // Make .snapshots/thefile directory
+  cerr << "Making" << newLocationBuilder.str() << endl;
+  err = mkdir( newLocationBuilder.str().c_str(), 0700);
+  // If we got an error that's not a "file already exists" error
+  if (err == -1 && errno != EEXIST) {
+    cerr << "Couldn't make " << newLocationBuilder.str() << " error was " << strerror(errno) << "(" << errno << ")" << endl;
+  }
+  newLocationBuilder << "/" << backup_name;
+
+  // Copy the file to .snapsots/thefile/thetime
+  cerr << "Copying to " << newLocationBuilder.str() << endl;
+  if (move) {
+    if (!moveFile(path, newLocationBuilder.str())) {
+      err = errno;
+      cerr << term_red << "Couldn't move " << path << " to "
+        << newLocationBuilder.str() << ": " << strerror(err) << term_reset << endl;
+      return -err;
+    }
+  } else {
+    copyFile(path, newLocationBuilder.str());
+  }
+
+  if (lstat(newLocationBuilder.str().c_str(), &st) == -1) {
+    return -errno;
+  }
+  BackupInfo info = {};
+  info.name = backup_name;
+  info.bytes = st.st_size;
+  info.pack_offset = -1;
+  // Record a checksum so the scrubber can tell if it rots later. Reading a
+  // file that is only being moved out of the way would make deleting it as
+  // slow as copying it, so those go to the scrubber to do straight away.
+  if (move && SCRUB_RATE > 0) {
+    info.has_checksum = false;
+  } else {
+    info.has_checksum = checksumFile(newLocationBuilder.str(), &info.checksum, 0)
+      && setChecksumAttribute(newLocationBuilder.str(), info.checksum);
+  }
+  BackupKey key = catalog_add(backup_dir, info);
+  if (!info.has_checksum) {
+    std::lock_guard<std::mutex> lock(scrub_queue_mutex);
+    scrub_queue.emplace_back(backup_dir, key);
+    scrub_queue_ready.notify_one();
+  }
+  enforce_quotas(snapshot_dir);
+  return 0;
+}
+
+// Moves one backup from the hot tier to the same place in the cold tier. The
+// data is copied and synced first, then the hot file is atomically swapped
+// for a symlink to the cold copy, so the backup never disappears from the
+// .elephant_snapshot directory while it moves.
+static void migrateBackup(const string& backup_path) {
+  string cold_path = coldtierdir + backup_path.substr(mirrordir.size());
+  string cold_dir;
+  std::tie(cold_dir, std::ignore) = break_off_last_path_entry(cold_path);
+  makeDirectories(cold_dir);
+
+  cerr << "Migrating " << backup_path << " to " << cold_path << endl;
+  string cold_temp_path = cold_path + ".migrating";
+  // The checksum attribute doesn't come along with the data
+  uint32_t checksum;
+  bool has_checksum = getChecksumAttribute(backup_path, &checksum);
+  if (!streamCopyFile(backup_path, cold_temp_path)
+      || (has_checksum && !setChecksumAttribute(cold_temp_path, checksum))
+      || rename(cold_temp_path.c_str(), cold_path.c_str()) == -1) {
+    cerr << term_red << "Couldn't copy " << backup_path << " to the cold tier" << term_reset << endl;
+    unlink(cold_temp_path.c_str());
+    return;
+  }
+
+  string link_temp_path = backup_path + ".migrating";
+  if (symlink(cold_path.c_str(), link_temp_path.c_str()) == -1
+      || rename(link_temp_path.c_str(), backup_path.c_str()) == -1) {
+    cerr << term_red << "Couldn't point " << backup_path << " at the cold tier" << term_reset << endl;
+    unlink(link_temp_path.c_str());
+    unlink(cold_path.c_str());
+  }
+}
+
+// Moves every backup in the given .elephant_snapshot directory that is older
+// than COLD_TIER_AGE to the cold tier
+static void migrate_backups(const string& current_directory) {
+  std::time_t cutoff = clk::to_time_t(clk::now()) - COLD_TIER_AGE;
+
+  directory_map(current_directory, [&current_directory, cutoff](const string& backup_dir_name) {
+    // Packs stay in the hot tier
+    if (backup_dir_name == SNAPSHOT_DIRECTORY_NAME) {
+      return;
+    }
+    string next_path = current_directory + "/" + backup_dir_name;
+
+    directory_map(next_path, [&next_path, cutoff](const string& backup_file_name) {
+      string backup_path = next_path + "/" + backup_file_name;
+      struct stat st;
+      // Already migrated backups are symlinks
+      if (lstat(backup_path.c_str(), &st) == -1 || !S_ISREG(st.st_mode)) {
+        return;
+      }
+
+      std::time_t backup_time;
+      std::tie(backup_time, std::ignore) =
+        get_time_and_iteration_from_filename(backup_file_name);
+      if (backup_time != 0 && backup_time < cutoff) {
+        migrateBackup(backup_path);
+      }
+    });
+  });
+}
+
+// Returns every file in the given .elephant_snapshot directory that has
+// backups, as (backup directory, backup names oldest first). This comes from
+// the catalog, since packed backups don't show up in the directory.
+static std::vector<std::pair<string, std::vector<string>>>
+    backups_in_snapshot_directory(const string& snapshot_dir) {
+  std::vector<std::pair<string, std::vector<string>>> files;
+  const string prefix = snapshot_dir + "/";
+
+  std::lock_guard<std::mutex> lock(catalog_mutex);
+  for (auto file_it = backup_catalog.lower_bound(prefix);
+       file_it != backup_catalog.end()
+         && file_it->first.compare(0, prefix.size(), prefix) == 0;
+       ++file_it) {
+    // Skip backups of backups, which are further down
+    if (file_it->first.find('/', prefix.size()) != string::npos) {
+      continue;
+    }
+    std::vector<string> names;
+    for (const auto& backup : file_it->second.backups) {
+      names.push_back(backup.second.name);
+    }
+    files.emplace_back(file_it->first, names);
+  }
+  return files;
+}
+
+static void cleanup_backups(const string& current_directory){
+  //clean one file at a time by drilling into its directory
+  cerr<< "entering backups folder " << current_directory<< std::endl;
+
+  // For each backed up file in this directory...
+  for (auto& backed_up_file : backups_in_snapshot_directory(current_directory)) {
+    // Vector of filenames for the backups for this file
+    std::vector<string>& backups = backed_up_file.second;
+    const string& next_path = backed_up_file.first;
+    cerr << "opening path: " << next_path << std::endl;
+
+    //get most recent value against which to compare rest
+    string mostRecentName;
+    int mostRecentDate;
+    int mostRecentIteration;
+    int prevIteration;
+    //cerr << "after abort test-1" << std::endl;
+    if(!backups.empty()){
+
+      mostRecentName = backups.back();
+      backups.pop_back();
+
+      cerr << term_yellow << "Calling parse from cleanup_backups 1" << term_reset << endl;
+      std::tie(mostRecentDate, mostRecentIteration) =
+        get_time_and_iteration_from_filename(mostRecentName);
+      prevIteration = mostRecentIteration;
+    }
+
+    while(!backups.empty()){
+      string currName = backups.back();
+      backups.pop_back();
+
+      std::time_t now_as_time_t = clk::to_time_t(clk::now());
+
+      std::time_t thisFileTime;
+      size_t currIteration;
+      cerr << term_yellow << "Calling parse from cleanup_backups 2" << term_reset << endl;
+      std::tie(thisFileTime, currIteration) =
+        get_time_and_iteration_from_filename(currName);
+
+      if(keepFileEvaluation(now_as_time_t, thisFileTime, mostRecentIteration, prevIteration, currIteration)){
+        //iterationsSinceKept = 0;
+        prevIteration = currIteration;
+      } else {
+        //++iterationsSinceKept;
+        string full_dir = next_path + "/" + currName;
+        //cerr << "unlinking: " << full_dir << std::endl;
+        removeBackup(full_dir);
+      }
+    }
+
+  }
+
+//  DIR *dir = opendir(current_directory.c_str());
+//  struct dirent *entry = readdir(dir);
+//  while (entry != nullptr) {
+//    if( parentDir.compare(entry->d_name)  != 0 &&
+//        selfDir.compare(entry->d_name)    != 0){
+//      cerr<< "In cleanup if: " << entry->d_name << std::endl;  
+//      std::vector<string> backups;
+//      string next_path = ((string)current_directory + "/" + (string)entry->d_name);
+//      cerr << "opening path: " << next_path << std::endl;
+//      DIR *dir_backups = opendir(next_path.c_str());
+//      struct dirent *backup = readdir(dir_backups);
+//      cerr<< "Current Backup:" << backup->d_name << std::endl;
+//      while(backup != nullptr){
+//        if( parentDir.compare(backup->d_name) != 0 && //dont want to check .. and .
+//            selfDir.compare(backup->d_name) != 0){
+//          cerr << "Adding to backup list " << backup->d_name << std::endl;
+//          backups.push_back(backup->d_name);
+//        }
+//        backup = readdir(dir_backups);
+//      }
+//      closedir(dir_backups);
+//      //cerr << "after abort test-5" << std::endl;
+//      //alphabetical should make it oldest->newest
+//      std::sort(backups.begin(), backups.end());
+//      //get most recent value against which to compare rest
+//      string mostRecentName;
+//      int mostRecentDate;
+//      int mostRecentIteration;
+//      int iterationsSinceKept = 0;
+//      //cerr << "after abort test-1" << std::endl;
+//      if(!backups.empty()){
+//        mostRecentName = backups.back();
+//        backups.pop_back();
+//        std::string::size_type n = mostRecentName.find( '_' );
+//        mostRecentDate = stoi(mostRecentName.substr(0, n));
+//        //cerr << "date " << mostRecentDate << std::endl;
+//        mostRecentIteration = stoi(mostRecentName.substr(n+1));
+//        //cerr << "iteration " << mostRecentIteration << std::endl;
+//      }
+//      cerr << "after abort test1" << std::endl;
+//      while(!backups.empty()){
+//        string currName = backups.back();
+//        backups.pop_back();
+//        std::string::size_type separator_pos = currName.find( '_' );
+//
+//
+//        std::stringstream time_stringstream;
+//        time_stringstream << currName.substr(0,separator_pos);
+//        std::tm filetime_as_tm;
+//        time_stringstream >> std::get_time(&filetime_as_tm, backup_timestamp_fmt.c_str());
+//        std::time_t filetime_as_time_t = std::mktime(&filetime_as_tm);
+//
+//        size_t currIteration = stoi(currName.substr(separator_pos+1));
+//
+//        std::time_t now_as_time_t = clk::to_time_t(clk::now());
+//
+//        if(keepFileEvaluation(now_as_time_t, filetime_as_time_t, mostRecentIteration, currIteration, iterationsSinceKept)){
+//          iterationsSinceKept = 0;
+//        } else {
+//          ++iterationsSinceKept;
+//          string full_dir = ((string)current_directory + "/" + (string)entry->d_name + "/" + currName);
+//          cerr << "unlinking: " << full_dir << std::endl;
+//          unlink(full_dir.c_str());
+//        }
+//      }
+//      cerr << "after abort test15" << std::endl;
+//    }
+//    entry = readdir(dir);
+//  }
+//  closedir(dir);
+//  return;
+}
+
+// Deleted directories. rm -r leaves the backups of everything it deleted
+// behind in .elephant_snapshot, so rmdir of a directory with nothing else in
+// it moves the whole directory, backups and all, into
+// .elephant_trash/<time>_<n>/ with one rename. The "delete <path>" control
+// command does the same for a tree that still has files in it, so getting rid
+// of a huge tree doesn't have to go file by file at all. The backups keep
+// their place in the catalog under their new paths, and trash_index knows
+// where each tree came from, so /.at/<time>/ and restore still find
+// everything from before it was deleted. The GC deletes trash for good once
+// it's TRASH_AGE old.
+
+static std::atomic<size_t> trash_generation(0);
+// Where a trash generation's directory used to be in the mount
+static const char* trash_origin_xattr_name = "user.elephant.origin";
+
+// A deleted tree: when it went to the trash and where it is now
+struct TrashedTree {
+  std::time_t trashed;
+  string path;
+};
+
+static std::mutex trash_mutex;
+// Keyed by where the tree was in the backend
+static std::multimap<string, TrashedTree> trash_index;
+
+static void index_trashed_tree(const string& origin, const TrashedTree& tree) {
+  std::lock_guard<std::mutex> lock(trash_mutex);
+  trash_index.emplace(origin, tree);
+}
+
+// Finds the first tree to go to the trash after when that had mirrorpath in
+// it, and puts where mirrorpath is now inside it in trashed_path
+static bool find_in_trash(const string& mirrorpath, std::time_t when,
+                          string* trashed_path) {
+  std::lock_guard<std::mutex> lock(trash_mutex);
+  bool found = false;
+  std::time_t first_trashed = 0;
+  // mirrorpath itself, then each directory above it
+  for (size_t end = mirrorpath.size();
+       !trash_index.empty() && end > mirrordir.size();
+       end = mirrorpath.rfind('/', end - 1)) {
+    auto range = trash_index.equal_range(mirrorpath.substr(0, end));
+    for (auto tree_it = range.first; tree_it != range.second; ++tree_it) {
+      const TrashedTree& tree = tree_it->second;
+      if (tree.trashed > when && (!found || tree.trashed < first_trashed)) {
+        found = true;
+        first_trashed = tree.trashed;
+        *trashed_path = tree.path + mirrorpath.substr(end);
+      }
+    }
+  }
+  return found;
+}
+
+// Every place in the trash that mirror_dir has been: where it is in trees
+// that were deleted with it in them. Also adds the names of the trees that
+// were deleted right out of mirror_dir to names.
+static std::vector<string> trashed_versions_of(const string& mirror_dir,
+                                               std::set<string>* names) {
+  std::vector<string> versions;
+  std::lock_guard<std::mutex> lock(trash_mutex);
+  if (trash_index.empty()) {
+    return versions;
+  }
+  for (size_t end = mirror_dir.size(); end > mirrordir.size();
+       end = mirror_dir.rfind('/', end - 1)) {
+    auto range = trash_index.equal_range(mirror_dir.substr(0, end));
+    for (auto tree_it = range.first; tree_it != range.second; ++tree_it) {
+      versions.push_back(tree_it->second.path + mirror_dir.substr(end));
+    }
+  }
+  const string prefix = mirror_dir + "/";
+  for (auto tree_it = trash_index.lower_bound(prefix);
+       tree_it != trash_index.end()
+         && tree_it->first.compare(0, prefix.size(), prefix) == 0;
+       ++tree_it) {
+    if (tree_it->first.find('/', prefix.size()) == string::npos) {
+      names->insert(tree_it->first.substr(prefix.size()));
+    }
+  }
+  return versions;
+}
+
+// Whether path is inside .elephant_trash, which can't be changed
+static bool is_trash_path(const string& path) {
+  const string top = "/" + TRASH_DIRECTORY_NAME;
+  return path.compare(0, top.size(), top) == 0
+    && (path.size() == top.size() || path[top.size()] == '/');
+}
+
+// Whether the backend directory dir has nothing left in it but backups
+static bool only_backups_left(const string& dir) {
+  bool only_backups = true;
+  directory_map(dir, [&only_backups](const string& name) {
+    if (name != SNAPSHOT_DIRECTORY_NAME) {
+      only_backups = false;
+    }
+  });
+  return only_backups;
+}
+
+// Drops every backup under the backend directory dir from the catalog, for
+// when the whole tree is about to be deleted. Returns how many bytes they
+// used.
+static off_t catalog_forget_tree(const string& dir) {
+  const string prefix = dir + "/";
+  auto in_tree = [&prefix](const string& path) {
+    return path.compare(0, prefix.size(), prefix) == 0;
+  };
+
+  std::lock_guard<std::mutex> pack_lock(pack_mutex);
+  for (auto pack_it = packs.lower_bound(prefix);
+       pack_it != packs.end() && in_tree(pack_it->first); ) {
+    pack_it = packs.erase(pack_it);
+  }
+
+  off_t bytes = 0;
+  std::vector<std::pair<string, BackupKey>> forgotten;
+  {
+    std::lock_guard<std::mutex> lock(catalog_mutex);
+    for (auto file_it = backup_catalog.lower_bound(prefix);
+         file_it != backup_catalog.end() && in_tree(file_it->first);
+         ++file_it) {
+      bytes += file_it->second.bytes;
+      for (const auto& backup : file_it->second.backups) {
+        forgotten.emplace_back(file_it->first, backup.first);
+      }
+    }
+  }
+  for (const auto& backup : forgotten) {
+    catalog_remove(backup.first, backup.second);
+  }
+  return bytes;
+}
+
+// Moves the tree at path (in the mount) into a new trash generation
+static int trash_tree(const string& path) {
+  string mirrorpath = mirrordir + path;
+  string name;
+  std::tie(std::ignore, name) = break_off_last_path_entry(mirrorpath);
+
+  string trash_dir = mirrordir + "/" + TRASH_DIRECTORY_NAME;
+  if (mkdir(trash_dir.c_str(), 0700) == -1 && errno != EEXIST) {
+    return -errno;
+  }
+  std::stringstream name_builder;
+  name_builder << trash_dir << "/" << current_timestring() << "_" << ++trash_generation;
+  string generation_dir = name_builder.str();
+  if (mkdir(generation_dir.c_str(), 0700) == -1) {
+    return -errno;
+  }
+  if (rename(mirrorpath.c_str(), (generation_dir + "/" + name).c_str()) == -1) {
+    int err = errno;
+    rmdir(generation_dir.c_str());
+    return -err;
+  }
+  setxattr(generation_dir.c_str(), trash_origin_xattr_name, path.data(),
+           path.size(), 0);
+
+  forget_listing(mirrorpath);
+  forget_parent_listing(mirrorpath);
+  catalog_move_tree(mirrorpath, generation_dir + "/" + name);
+  index_trashed_tree(mirrorpath, TrashedTree{time(nullptr), generation_dir + "/" + name});
+  cerr << term_yellow << "Moved " << mirrorpath << " to " << generation_dir
+    << term_reset << endl;
+  return 0;
+}
+
+// Finds the existing trash generations at mount, so new ones don't reuse
+// their names
+static void load_trash() {
+  string trash_dir = mirrordir + "/" + TRASH_DIRECTORY_NAME;
+  if (access(trash_dir.c_str(), F_OK) == -1) {
+    return;
+  }
+  directory_map(trash_dir, [&trash_dir](const string& name) {
+    string generation_dir = trash_dir + "/" + name;
+    TrashedTree tree;
+    size_t generation;
+    std::tie(tree.trashed, generation) = get_time_and_iteration_from_filename(name);
+    trash_generation = std::max(trash_generation.load(), generation);
+
+    char origin[PATH_MAX];
+    ssize_t len = getxattr(generation_dir.c_str(), trash_origin_xattr_name,
+                           origin, sizeof(origin));
+    if (len <= 0) {
+      return;
+    }
+    string origin_path(origin, len);
+    string tree_name;
+    std::tie(std::ignore, tree_name) = break_off_last_path_entry(origin_path);
+    tree.path = generation_dir + "/" + tree_name;
+    index_trashed_tree(mirrordir + origin_path, tree);
+  });
+}
+
+// Deletes the tree at dir for good, along with the cold tier copies of any
+// backups in it
+static void remove_tree(const string& dir, bool in_snapshot_directory) {
+  directory_map(dir, [&dir, in_snapshot_directory](const string& name) {
+    string full_path = dir + "/" + name;
+    struct stat st;
+    if (lstat(full_path.c_str(), &st) == -1) {
+      return;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      remove_tree(full_path,
+                  in_snapshot_directory || name == SNAPSHOT_DIRECTORY_NAME);
+      return;
+    }
+    if (in_snapshot_directory && S_ISLNK(st.st_mode)) {
+      string cold_path = follow_cold_tier_link(full_path);
+      if (cold_path != full_path) {
+        unlink(cold_path.c_str());
+      }
+    }
+    unlink(full_path.c_str());
+  });
+  if (rmdir(dir.c_str()) == -1) {
+    cerr << term_red << "Couldn't remove " << dir << ": " << strerror(errno)
+      << term_reset << endl;
+  }
+}
+
+// Deletes the trash generations that are older than TRASH_AGE
+static void expire_trash() {
+  string trash_dir = mirrordir + "/" + TRASH_DIRECTORY_NAME;
+  if (access(trash_dir.c_str(), F_OK) == -1) {
+    return;
+  }
+  std::time_t now = time(nullptr);
+  directory_map(trash_dir, [&trash_dir, now](const string& name) {
+    std::time_t trashed;
+    std::tie(trashed, std::ignore) = get_time_and_iteration_from_filename(name);
+    if (now - trashed > TRASH_AGE) {
+      string generation_dir = trash_dir + "/" + name;
+      {
+        std::lock_guard<std::mutex> lock(trash_mutex);
+        const string prefix = generation_dir + "/";
+        for (auto tree_it = trash_index.begin(); tree_it != trash_index.end(); ) {
+          if (tree_it->second.path.compare(0, prefix.size(), prefix) == 0) {
+            tree_it = trash_index.erase(tree_it);
+          } else {
+            ++tree_it;
+          }
+        }
+      }
+      off_t bytes = catalog_forget_tree(generation_dir);
+      cerr << term_yellow << "Emptying " << generation_dir << ", "
+        << bytes << " bytes of backups" << term_reset << endl;
+      remove_tree(generation_dir, false);
+    }
+  });
+}
+
+//work way down the directory tree
+//everytime it sees a .elephant_snapshot folder, call cleanup
+static void traverse_directory_tree(const string current_directory){
+
+  directory_map(current_directory, [&current_directory](const string& dirname) {
+    string full_path = current_directory + "/" + dirname;
+    struct stat st;
+    lstat(full_path.c_str(), &st);
+    cerr << "just stated: " << full_path << std::endl;
+
+    if(S_ISDIR(st.st_mode) && dirname != GENERATIONS_DIRECTORY_NAME
+       && dirname != TRASH_DIRECTORY_NAME){
+      //clean in the snapshot_directory, keep traversing otherwise
+      if(dirname == SNAPSHOT_DIRECTORY_NAME){
+        cleanup_backups(full_path);
+        compact_pack(full_path);
+        if (!coldtierdir.empty()) {
+          migrate_backups(full_path);
+        }
+      } else {
+        traverse_directory_tree(full_path);
+      }
+    }
+  });
+}
+
+static void collectGarbage(){
+  while(true){
+    sleep(GARBAGE_INTERVAL);
+    expire_trash();
+    traverse_directory_tree(mirrordir);
+    enforce_quotas("");
+
+    std::lock_guard<std::mutex> lock(catalog_mutex);
+    cerr << "Backups of " << backup_catalog.size() << " files are using "
+      << total_backup_bytes << " bytes" << endl;
+  }
+}
+
+// The scrubber: goes through every backup in the catalog, SCRUB_RATE bytes
+// per second at most, and checks that it still matches its checksum.
+// Backups from before checksums were kept get one the first time through.
+
+static std::mutex scrub_mutex;
+static size_t scrub_checked = 0;
+static size_t scrub_corrupt = 0;
+static std::vector<string> scrub_corrupt_backups; // the latest few of them
+static const size_t scrub_corrupt_backups_kept = 100;
+
+// Finds the backup after (backup_dir, key) in the catalog, and moves them to
+// point at it. Returns false once there are no more.
+static bool next_backup_to_scrub(string* backup_dir, BackupKey* key,
+                                 string* backup_path, BackupInfo* info) {
+  std::lock_guard<std::mutex> lock(catalog_mutex);
+  auto file_it = backup_catalog.lower_bound(*backup_dir);
+  if (file_it != backup_catalog.end() && file_it->first == *backup_dir) {
+    auto backup_it = file_it->second.backups.upper_bound(*key);
+    if (backup_it != file_it->second.backups.end()) {
+      *key = backup_it->first;
+      *info = backup_it->second;
+      *backup_path = *backup_dir + "/" + info->name;
+      return true;
+    }
+    ++file_it;
+  }
+  if (file_it == backup_catalog.end()) {
+    return false;
+  }
+  *backup_dir = file_it->first;
+  *key = file_it->second.backups.begin()->first;
+  *info = file_it->second.backups.begin()->second;
+  *backup_path = *backup_dir + "/" + info->name;
+  return true;
+}
+
+// Notes down a backup that failed its check
+static void report_corrupt_backup(const string& backup_path) {
+  cerr << term_red << "Backup " << backup_path << " is corrupt" << term_reset << endl;
+  std::lock_guard<std::mutex> lock(scrub_mutex);
+  ++scrub_corrupt;
+  scrub_corrupt_backups.push_back(backup_path);
+  if (scrub_corrupt_backups.size() > scrub_corrupt_backups_kept) {
+    scrub_corrupt_backups.erase(scrub_corrupt_backups.begin());
+  }
+}
+
+static void scrub_backup(const string& backup_dir, const BackupKey& key,
+                         const string& backup_path, const BackupInfo& info) {
+  uint32_t checksum;
+  bool readable;
+  if (info.pack_offset >= 0) {
+    string snapshot_dir;
+    std::tie(snapshot_dir, std::ignore) = break_off_last_path_entry(backup_dir);
+    readable = checksumFile(pack_file_path(snapshot_dir, info.pack_number),
+                            &checksum, SCRUB_RATE, info.pack_offset, info.bytes);
+  } else {
+    readable = checksumFile(backup_path, &checksum, SCRUB_RATE);
+  }
+  if (!readable) {
+    int err = errno;
+    if (err == ENOENT) {
+      // Fine if it was pruned, packed or compacted while we were getting to
+      // it. If the catalog still has it where we looked, it's gone missing.
+      std::lock_guard<std::mutex> lock(catalog_mutex);
+      auto file_it = backup_catalog.find(backup_dir);
+      if (file_it == backup_catalog.end()) {
+        return;
+      }
+      auto backup_it = file_it->second.backups.find(key);
+      if (backup_it == file_it->second.backups.end()
+          || backup_it->second.pack_offset != info.pack_offset
+          || (info.pack_offset >= 0
+              && backup_it->second.pack_number != info.pack_number)) {
+        return;
+      }
+    }
+    cerr << term_red << "Scrubber couldn't read " << backup_path << ": "
+      << strerror(err) << term_reset << endl;
+    report_corrupt_backup(backup_path);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(scrub_mutex);
+    ++scrub_checked;
+  }
+  if (info.has_checksum) {
+    if (checksum != info.checksum) {
+      report_corrupt_backup(backup_path);
+    }
+    return;
+  }
+
+  // Nothing to compare against yet, so this becomes the checksum
+  if (setChecksumAttribute(backup_path, checksum)) {
+    std::lock_guard<std::mutex> lock(catalog_mutex);
+    auto file_it = backup_catalog.find(backup_dir);
+    if (file_it != backup_catalog.end()) {
+      auto backup_it = file_it->second.backups.find(key);
+      if (backup_it != file_it->second.backups.end()) {
+        backup_it->second.has_checksum = true;
+        backup_it->second.checksum = checksum;
+      }
+    }
+  }
+}
+
+// Checksums everything in scrub_queue, until it's empty
+static void scrub_queued_backups() {
+  while (true) {
+    std::pair<string, BackupKey> queued;
+    {
+      std::lock_guard<std::mutex> lock(scrub_queue_mutex);
+      if (scrub_queue.empty()) {
+        return;
+      }
+      queued = scrub_queue.front();
+      scrub_queue.pop_front();
+    }
+
+    BackupInfo info;
+    {
+      std::lock_guard<std::mutex> lock(catalog_mutex);
+      auto file_it = backup_catalog.find(queued.first);
+      if (file_it == backup_catalog.end()) {
+        continue;
+      }
+      auto backup_it = file_it->second.backups.find(queued.second);
+      if (backup_it == file_it->second.backups.end()) {
+        continue;
+      }
+      info = backup_it->second;
+    }
+    scrub_backup(queued.first, queued.second, queued.first + "/" + info.name, info);
+  }
+}
+
+static void scrub_backups() {
+  while (true) {
+    string backup_dir, backup_path;
+    BackupKey key;
+    BackupInfo info;
+    size_t checked = 0;
+    while (next_backup_to_scrub(&backup_dir, &key, &backup_path, &info)) {
+      scrub_queued_backups();
+      scrub_backup(backup_dir, key, backup_path, info);
+      ++checked;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(scrub_mutex);
+      cerr << term_yellow << "Scrubbed " << checked << " backups, "
+        << scrub_corrupt << " corrupt so far" << term_reset << endl;
+    }
+
+    // Until the next pass, just do new backups as they come in
+    auto next_pass = std::chrono::steady_clock::now()
+      + std::chrono::seconds(SCRUB_INTERVAL);
+    std::unique_lock<std::mutex> lock(scrub_queue_mutex);
+    while (scrub_queue_ready.wait_until(lock, next_pass,
+                                        []() { return !scrub_queue.empty(); })) {
+      lock.unlock();
+      scrub_queued_backups();
+      lock.lock();
+    }
+  }
+}
+
+
+// Snapshot generations: whole-tree snapshots made of hard links to the live
+// files, in .elephant_generations/<time>_<generation>/. Taking one only
+// copies metadata. Anything about to change a file that is still linked into
+// a generation first gives the generations their own copy of it
+// (preserve_for_snapshots), so they keep the contents from when they were
+// taken while the live file keeps its inode and other hard links.
+
+// Held shared by everything that changes the tree, and exclusively while a
+// snapshot is being taken so that it sees a single consistent state
+static std::shared_timed_mutex snapshot_mutex;
+// Inodes that are linked into a generation, and the paths they're linked to
+// there. Added to with snapshot_mutex held exclusively, and taken out of with
+// it held shared and generation_inodes_mutex held as well.
+static std::unordered_map<ino_t, std::vector<string>> generation_inodes;
+static std::mutex generation_inodes_mutex;
+static std::atomic<size_t> snapshot_generation(0);
+
+// Whether path is inside .elephant_generations, which can't be changed
+static bool is_generation_path(const string& path) {
+  const string top = "/" + GENERATIONS_DIRECTORY_NAME;
+  return path.compare(0, top.size(), top) == 0
+    && (path.size() == top.size() || path[top.size()] == '/');
+}
+
+// Mirrors the tree in from_dir into to_dir with hard links, skipping backups
+// and recording every linked inode
+static void link_tree(const string& from_dir, const string& to_dir) {
+  directory_map(from_dir, [&from_dir, &to_dir](const string& name) {
+    if (name == SNAPSHOT_DIRECTORY_NAME || name == GENERATIONS_DIRECTORY_NAME
+        || name == TRASH_DIRECTORY_NAME) {
+      return;
+    }
+    string from = from_dir + "/" + name;
+    string to = to_dir + "/" + name;
+    struct stat st;
+    if (lstat(from.c_str(), &st) == -1) {
+      return;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+      if (mkdir(to.c_str(), st.st_mode & 07777) == -1) {
+        cerr << "Couldn't make " << to << " error was " << strerror(errno) << "(" << errno << ")" << endl;
+        return;
+      }
+      link_tree(from, to);
+    } else if (link(from.c_str(), to.c_str()) == 0) {
+      generation_inodes[st.st_ino].push_back(to);
+    } else {
+      cerr << term_red << "Couldn't link " << from << " into the snapshot: "
+        << strerror(errno) << term_reset << endl;
+    }
+  });
+}
+
+// Takes a snapshot of the whole tree and returns the name of its generation
+static string take_snapshot() {
+  std::lock_guard<std::shared_timed_mutex> lock(snapshot_mutex);
+
+  string generations_dir = mirrordir + "/" + GENERATIONS_DIRECTORY_NAME;
+  makeDirectories(generations_dir);
+  std::stringstream name_builder;
+  name_builder << current_timestring() << "_" << ++snapshot_generation;
+  string generation_dir = generations_dir + "/" + name_builder.str();
+
+  cerr << term_yellow << "Taking snapshot " << generation_dir << term_reset << endl;
+  if (mkdir(generation_dir.c_str(), 0755) == -1) {
+    cerr << term_red << "Couldn't make " << generation_dir << ": " << strerror(errno) << term_reset << endl;
+    return "";
+  }
+  link_tree(mirrordir, generation_dir);
+  return name_builder.str();
+}
+
+// Finds the existing generations at mount, so that the inodes they share with
+// live files get copied before they change
+static void load_generations() {
+  string generations_dir = mirrordir + "/" + GENERATIONS_DIRECTORY_NAME;
+  if (access(generations_dir.c_str(), F_OK) == -1) {
+    return;
+  }
+
+  std::function<void(const string&)> record_inodes =
+    [&record_inodes](const string& dirname) {
+      directory_map(dirname, [&dirname, &record_inodes](const string& name) {
+        string full_path = dirname + "/" + name;
+        struct stat st;
+        if (lstat(full_path.c_str(), &st) == -1) {
+          return;
+        }
+        if (S_ISDIR(st.st_mode)) {
+          record_inodes(full_path);
+        } else if (st.st_nlink > 1) {
+          generation_inodes[st.st_ino].push_back(full_path);
+        }
+      });
+    };
+
+  directory_map(generations_dir, [&generations_dir, &record_inodes](const string& name) {
+    size_t generation;
+    std::tie(std::ignore, generation) = get_time_and_iteration_from_filename(name);
+    snapshot_generation = std::max(snapshot_generation.load(), generation);
+    record_inodes(generations_dir + "/" + name);
+  });
+}
+
+// Called before changing the file at mirrorpath in place. If the file still
+// shares its inode with a generation, the generation's links are replaced
+// with a copy of it first. The copy is made once and linked into every
+// generation that had the file. The live file is left alone, so it keeps
+// its inode, its birth time and any hard links of its own.
+// Must be called with snapshot_mutex held shared.
+static int preserve_for_snapshots(const string& mirrorpath) {
+  struct stat st;
+  if (lstat(mirrorpath.c_str(), &st) == -1 || !S_ISREG(st.st_mode)
+      || st.st_nlink < 2) {
+    return 0;
+  }
+  // Held while copying, so nobody else writes to the file before the
+  // generations have their copy
+  std::lock_guard<std::mutex> lock(generation_inodes_mutex);
+  auto linked = generation_inodes.find(st.st_ino);
+  if (linked == generation_inodes.end()) {
+    return 0;
+  }
+
+  cerr << term_yellow << "Copying " << mirrorpath << " out to its snapshots" << term_reset << endl;
+  string first_copy;
+  for (const string& generation_path : linked->second) {
+    string containing_dir, filename;
+    std::tie(containing_dir, filename) = break_off_last_path_entry(generation_path);
+    string private_copy = containing_dir + "/." + filename + ".elephant_copy";
+    bool copied = first_copy.empty()
+      ? cloneFile(mirrorpath, private_copy)
+      : link(first_copy.c_str(), private_copy.c_str()) == 0;
+    if (!copied || rename(private_copy.c_str(), generation_path.c_str()) == -1) {
+      int err = errno;
+      cerr << term_red << "Couldn't copy " << mirrorpath << " to " << generation_path
+        << ": " << strerror(err) << term_reset << endl;
+      unlink(private_copy.c_str());
+      return copied ? -err : -EIO;
+    }
+    if (first_copy.empty()) {
+      first_copy = generation_path;
+    }
+  }
+  generation_inodes.erase(linked);
+  return 0;
+}
+
+// Whether path is in the read-only /.at/ time travel view
+static bool is_time_travel_path(const string& path) {
+  const string top = "/" + TIME_TRAVEL_DIRECTORY_NAME;
+  return path.compare(0, top.size(), top) == 0
+    && (path.size() == top.size() || path[top.size()] == '/');
+}
+
+// Whether path is one that can't be changed through the mount
+static bool is_read_only_path(const string& path) {
+  return is_time_travel_path(path) || is_generation_path(path)
+    || is_trash_path(path) || path == "/" + CONTROL_FILE_NAME;
+}
+
+// Parses a time in any of time_travel_timestamp_fmts
+static bool parse_time_travel_stamp(const string& stamp, std::time_t* when) {
+  for (const char* fmt : time_travel_timestamp_fmts) {
+    std::tm stamp_as_tm = {};
+    stamp_as_tm.tm_isdst = -1;
+    std::istringstream stamp_stream(stamp);
+    stamp_stream >> std::get_time(&stamp_as_tm, fmt);
+    // Only take it if the whole thing parsed
+    if (!stamp_stream.fail() && stamp_stream.peek() == EOF) {
+      *when = std::mktime(&stamp_as_tm);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Splits /.at/<time>/rest into the time and /rest (empty for the top of the
+// tree). Returns false if path has no time or it doesn't parse.
+static bool parse_time_travel_path(const string& path, std::time_t* when,
+                                   string* rest) {
+  const size_t stamp_pos = TIME_TRAVEL_DIRECTORY_NAME.size() + 2;
+  if (path.size() <= stamp_pos) {
+    return false;
+  }
+  size_t rest_pos = path.find('/', stamp_pos);
+  if (rest_pos == string::npos) {
+    rest_pos = path.size();
+  }
+  if (!parse_time_travel_stamp(path.substr(stamp_pos, rest_pos - stamp_pos), when)) {
+    return false;
+  }
+  *rest = path.substr(rest_pos);
+  return true;
+}
+
+// Where one version of a file can be read from: the whole of path, or for a
+// packed backup, length bytes at offset in the pack at path
+struct BackupSource {
+  string path;
+  off_t offset = -1;
+  off_t length = 0;
+  mode_t mode = 0;
+  uid_t uid = 0;
+  gid_t gid = 0;
+  std::time_t mtime = 0;
+};
+
+static int source_stat(const BackupSource& source, struct stat *st) {
+  if (lstat(source.path.c_str(), st) == -1) {
+    return -errno;
+  }
+  if (source.offset >= 0) {
+    st->st_mode = S_IFREG | source.mode;
+    st->st_uid = source.uid;
+    st->st_gid = source.gid;
+    st->st_nlink = 1;
+    st->st_size = source.length;
+    st->st_blocks = (source.length + 511) / 512;
+    st->st_mtime = st->st_ctime = source.mtime;
+  }
+  return 0;
+}
+
+// Like pread, but on a BackupSource
+static int source_read(const BackupSource& source, char *buf, size_t size,
+                       off_t offset) {
+  if (source.offset >= 0) {
+    if (offset >= source.length) {
+      return 0;
+    }
+    size = std::min<off_t>(size, source.length - offset);
+    offset += source.offset;
+  }
+  int fd = open(source.path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return -errno;
+  }
+  int res = pread(fd, buf, size, offset);
+  if (res == -1) {
+    res = -errno;
+  }
+  close(fd);
+  return res;
+}
+
+// Copies a packed backup out of its pack into a file of its own
+static bool copyPackedBackup(const BackupSource& source, const string& to) {
+  std::vector<char> contents(source.length);
+  if (source_read(source, contents.data(), contents.size(), 0) != source.length) {
+    return false;
+  }
+  int fd = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, source.mode);
+  if (fd == -1) {
+    return false;
+  }
+  fchown(fd, source.uid, source.gid);
+  const struct timespec times[2] = { {source.mtime, 0}, {source.mtime, 0} };
+  bool ok = write(fd, contents.data(), contents.size()) == source.length
+    && futimens(fd, times) == 0 && fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+// Whether the file at path was made after when, going by its birth time.
+// Filesystems without one give no such evidence, so the file is shown: ctime
+// also moves on writes, chmod and rename, and would hide files that did exist.
+static bool created_after(const string& path, std::time_t when) {
+  struct statx stx;
+  return statx(AT_FDCWD, path.c_str(), AT_SYMLINK_NOFOLLOW, STATX_BTIME, &stx) == 0
+    && (stx.stx_mask & STATX_BTIME) && stx.stx_btime.tv_sec > when;
+}
+
+// Works out where the contents mirrorpath had at time when are now, and puts
+// that in source. A backup holds what the file contained right up until
+// the backup was taken, so that's the oldest backup taken after when, or the
+// file itself if it hasn't been backed up since and was already there then.
+// Directories aren't versioned and are always themselves. Returns false if
+// there was no such file then.
+static bool resolve_at_time(const string& mirrorpath, std::time_t when,
+                            BackupSource* source) {
+  // If it was deleted along with its directory since, it's in the trash as
+  // it was then
+  string trashed_path;
+  if (find_in_trash(mirrorpath, when, &trashed_path)) {
+    return resolve_at_time(trashed_path, when, source);
+  }
+
+  struct stat st;
+  bool exists_now = lstat(mirrorpath.c_str(), &st) == 0;
+  *source = BackupSource();
+  if (exists_now && S_ISDIR(st.st_mode)) {
+    // The top of the tree is always there
+    if (mirrorpath.size() > mirrordir.size() + 1
+        && created_after(mirrorpath, when)) {
+      return false;
+    }
+    source->path = mirrorpath;
+    return true;
+  }
+
+  string containing_dir, filename;
+  std::tie(containing_dir, filename) = break_off_last_path_entry(mirrorpath);
+  string backup_dir =
+    containing_dir + "/" + SNAPSHOT_DIRECTORY_NAME + "/" + filename;
+  {
+    std::lock_guard<std::mutex> lock(catalog_mutex);
+    auto file_it = backup_catalog.find(backup_dir);
+    if (file_it != backup_catalog.end()) {
+      // Binary search for the first backup with a time after when
+      const auto& backups = file_it->second.backups;
+      auto backup_it = backups.upper_bound(
+        BackupKey(when, std::numeric_limits<size_t>::max()));
+      if (backup_it != backups.end()) {
+        const BackupInfo& info = backup_it->second;
+        if (info.pack_offset >= 0) {
+          source->path = pack_file_path(containing_dir + "/" + SNAPSHOT_DIRECTORY_NAME,
+                                        info.pack_number);
+          source->offset = info.pack_offset;
+          source->length = info.bytes;
+          source->mode = info.mode;
+          source->uid = info.uid;
+          source->gid = info.gid;
+          source->mtime = info.mtime;
+        } else {
+          source->path = follow_cold_tier_link(backup_dir + "/" + info.name);
+        }
+        return true;
+      }
+    }
+  }
+
+  if (exists_now && !created_after(mirrorpath, when)) {
+    source->path = mirrorpath;
+    return true;
+  }
+  return false;
+}
+
+// Finds where the file at a /.at/<time>/ path came from
+static int time_travel_resolve(const string& path, BackupSource* source) {
+  std::time_t when;
+  string rest;
+  if (!parse_time_travel_path(path, &when, &rest)) {
+    return -ENOENT;
+  }
+  if (!resolve_at_time(mirrordir + rest, when, source)) {
+    return -ENOENT;
+  }
+  return 0;
+}
+
+static int time_travel_getattr(const string& path, struct stat *stbuf) {
+  BackupSource source;
+  source.path = mirrordir;
+  // /.at itself looks like the top of the tree
+  if (path.size() > TIME_TRAVEL_DIRECTORY_NAME.size() + 1) {
+    int res = time_travel_resolve(path, &source);
+    if (res != 0) {
+      return res;
+    }
+  }
+  int res = source_stat(source, stbuf);
+  if (res != 0) {
+    return res;
+  }
+  stbuf->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+  return 0;
+}
+
+// Returns the names of everything in mirror_dir now, plus everything in it
+// that has backups, plus everything that was in it before going to the trash
+static std::set<string> names_with_history(const string& mirror_dir) {
+  std::set<string> names;
+  if (access(mirror_dir.c_str(), F_OK) == 0) {
+    directory_map(mirror_dir, [&names](const string& name) {
+      if (name != SNAPSHOT_DIRECTORY_NAME) {
+        names.insert(name);
+      }
+    });
+  }
+  string snapshot_dir = mirror_dir + "/" + SNAPSHOT_DIRECTORY_NAME;
+  for (const auto& backed_up_file : backups_in_snapshot_directory(snapshot_dir)) {
+    string name;
+    std::tie(std::ignore, name) = break_off_last_path_entry(backed_up_file.first);
+    names.insert(name);
+  }
+  for (const string& trashed_dir : trashed_versions_of(mirror_dir, &names)) {
+    std::set<string> trashed_names = names_with_history(trashed_dir);
+    names.insert(trashed_names.begin(), trashed_names.end());
+  }
+  return names;
+}
+
+// Lists everything that existed at the given time in a /.at/<time>/
+// directory: what's there now plus anything with backups, minus what didn't
+// exist yet or had already been deleted. These aren't cached, they're only
+// kept for as long as the directory is open.
+static int time_travel_listing(const string& path, DirectoryListing *listing) {
+  listing->entries.push_back({selfDir, 0, S_IFDIR});
+  listing->entries.push_back({parentDir, 0, S_IFDIR});
+  // There's nothing to list in /.at itself, the times are made up on lookup
+  if (path.size() <= TIME_TRAVEL_DIRECTORY_NAME.size() + 1) {
+    return 0;
+  }
+
+  std::time_t when;
+  string rest;
+  if (!parse_time_travel_path(path, &when, &rest)) {
+    return -ENOENT;
+  }
+  string mirrorpath = mirrordir + rest;
+  BackupSource directory;
+  if (!resolve_at_time(mirrorpath, when, &directory)) {
+    return -ENOENT;
+  }
+  struct stat st;
+  int res = source_stat(directory, &st);
+  if (res != 0) {
+    return res;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return -ENOTDIR;
+  }
+
+  for (const string& name : names_with_history(mirrorpath)) {
+    BackupSource source;
+    if (!resolve_at_time(mirrorpath + "/" + name, when, &source)) {
+      continue;
+    }
+    if (source_stat(source, &st) != 0) {
+      continue;
+    }
+    listing->entries.push_back({name, st.st_ino, st.st_mode & S_IFMT});
+  }
+  return 0;
+}
 
-      largest_previous_revision_number
-        = std::max(largest_previous_revision_number, revision_number);
+// Restoring a subtree to how it was at some time. Every file whose contents
+// then differ from now gets the old contents copied back (reflinked where
+// possible) by a pool of threads. The current contents are backed up first,
+// so a restore can itself be undone. Files that didn't exist yet at that
+// time are left alone.
+
+static std::atomic<bool> restore_running(false);
+static std::atomic<size_t> restore_total(0);
+static std::atomic<size_t> restore_done(0);
+static std::atomic<size_t> restore_failed(0);
+
+// One file to put back: where the old contents are and where they go
+struct RestoreItem {
+  BackupSource source;
+  string destination;
+};
 
-  });
+// Finds every file under mirror_dir that has to change to look like it did
+// at time when
+static void plan_restore(const string& mirror_dir, std::time_t when,
+                         std::vector<RestoreItem>* plan) {
+  for (const string& name : names_with_history(mirror_dir)) {
+    if (name == GENERATIONS_DIRECTORY_NAME || name == TRASH_DIRECTORY_NAME) {
+      continue;
+    }
+    string destination = mirror_dir + "/" + name;
+    BackupSource source;
+    if (!resolve_at_time(destination, when, &source)) {
+      continue;
+    }
+    struct stat st;
+    if (source.offset < 0 && lstat(source.path.c_str(), &st) == 0
+        && S_ISDIR(st.st_mode)) {
+      // A directory that has been deleted since comes back out of the trash
+      if (source.path != destination) {
+        std::shared_lock<std::shared_timed_mutex> snapshot_lock(snapshot_mutex);
+        if (mkdir(destination.c_str(), st.st_mode & 07777) == 0) {
+          forget_parent_listing(destination);
+        }
+      }
+      plan_restore(destination, when, plan);
+      continue;
+    }
+    if (source.path == destination) {
+      // Unchanged since then
+      continue;
+    }
+    plan->push_back(RestoreItem{source, destination});
+  }
+}
 
-  newLocationBuilder << "/" << timestring << "_" << largest_previous_revision_number+1;
+// Puts the old contents back for one file
+static bool restore_one(const RestoreItem& item) {
+  string containing_dir, filename;
+  std::tie(containing_dir, filename) = break_off_last_path_entry(item.destination);
+  string restored = containing_dir + "/." + filename + ".elephant_restore";
 
-  // Copy the file to .snapsots/thefile/thetime
-  cerr << "Copying to " << newLocationBuilder.str() << endl;
-  if (move) {
-    moveFile(path, newLocationBuilder.str());
+  // Backups of symlinks are symlinks, which copying would follow
+  struct stat st;
+  if (source_stat(item.source, &st) != 0) {
+    return false;
+  }
+  bool copied;
+  if (item.source.offset >= 0) {
+    copied = copyPackedBackup(item.source, restored);
+  } else if (S_ISLNK(st.st_mode)) {
+    char target[PATH_MAX];
+    ssize_t len = readlink(item.source.path.c_str(), target, sizeof(target) - 1);
+    copied = len != -1;
+    if (copied) {
+      target[len] = '\0';
+      copied = symlink(target, restored.c_str()) == 0;
+    }
   } else {
-    copyFile(path, newLocationBuilder.str());
+    copied = cloneFile(item.source.path, restored);
   }
-}
-
-static void cleanup_backups(const string& current_directory){
-  //clean one file at a time by drilling into its directory
-  cerr<< "entering backups folder " << current_directory<< std::endl;
+  if (!copied) {
+    unlink(restored.c_str());
+    return false;
+  }
+  lchown(restored.c_str(), st.st_uid, st.st_gid);
 
-  // For each backed up file in this directory...
-  directory_map(current_directory, [&current_directory](const string& backup_dir_name) {
-    // Vector of filenames for the backups for this file
-    std::vector<string> backups;
-    string next_path = current_directory + "/" + backup_dir_name;
-    cerr << "opening path: " << next_path << std::endl;
+  std::shared_lock<std::shared_timed_mutex> snapshot_lock(snapshot_mutex);
+  if (access(item.destination.c_str(), F_OK) == 0) {
+    backupFile(item.destination, true);
+  }
+  if (rename(restored.c_str(), item.destination.c_str()) == -1) {
+    unlink(restored.c_str());
+    return false;
+  }
+  forget_parent_listing(item.destination);
+  return true;
+}
 
-    directory_map(next_path, [&backups](const string& backup_file_name) {
-      backups.push_back(backup_file_name);
+// Restores everything under mirror_dir to how it was at time when. Runs on
+// its own thread; progress is in restore_done and friends.
+static void restore_tree(const string& mirror_dir, std::time_t when) {
+  std::vector<RestoreItem> plan;
+  plan_restore(mirror_dir, when, &plan);
+  restore_total = plan.size();
+  cerr << term_yellow << "Restoring " << plan.size() << " files under "
+    << mirror_dir << term_reset << endl;
+
+  size_t thread_count = RESTORE_THREADS > 0 ? RESTORE_THREADS
+    : std::max(1u, std::thread::hardware_concurrency());
+  std::atomic<size_t> next_item(0);
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < std::min(thread_count, plan.size()); ++i) {
+    workers.emplace_back([&plan, &next_item]() {
+      for (size_t item = next_item++; item < plan.size(); item = next_item++) {
+        if (!restore_one(plan[item])) {
+          cerr << term_red << "Couldn't restore " << plan[item].destination
+            << " from " << plan[item].source.path << term_reset << endl;
+          ++restore_failed;
+        }
+        size_t done = ++restore_done;
+        if (done % 1000 == 0) {
+          cerr << term_yellow << "Restored " << done << " of " << plan.size()
+            << " files" << term_reset << endl;
+        }
+      }
     });
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
 
-    std::sort(backups.begin(), backups.end());
-    //get most recent value against which to compare rest
-    string mostRecentName;
-    int mostRecentDate;
-    int mostRecentIteration;
-    int prevIteration;
-    //cerr << "after abort test-1" << std::endl;
-    if(!backups.empty()){
-
-      mostRecentName = backups.back();
-      backups.pop_back();
+  cerr << term_yellow << "Restore of " << mirror_dir << " finished, "
+    << restore_failed << " of " << plan.size() << " files failed"
+    << term_reset << endl;
+  restore_running = false;
+}
 
-      cerr << term_yellow << "Calling parse from cleanup_backups 1" << term_reset << endl;
-      std::tie(mostRecentDate, mostRecentIteration) =
-        get_time_and_iteration_from_filename(mostRecentName);
-      prevIteration = mostRecentIteration;
-    }
+// Starts restoring the tree at path (in the mount) to how it was at when, in
+// the background
+static int start_restore(const string& path, std::time_t when) {
+  if (path.empty() || path[0] != '/' || is_read_only_path(path)) {
+    return -EINVAL;
+  }
+  string mirrorpath = path == "/" ? mirrordir : mirrordir + path;
+  struct stat st;
+  if (lstat(mirrorpath.c_str(), &st) == -1) {
+    return -errno;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return -ENOTDIR;
+  }
 
-    while(!backups.empty()){
-      string currName = backups.back();
-      backups.pop_back();
+  if (restore_running.exchange(true)) {
+    return -EBUSY;
+  }
+  restore_total = 0;
+  restore_done = 0;
+  restore_failed = 0;
+  std::thread(restore_tree, mirrorpath, when).detach();
+  return 0;
+}
 
-      std::time_t now_as_time_t = clk::to_time_t(clk::now());
+// The control file, /.elephant_control. Writing a command to it runs the
+// command, reading it gives the state of things.
 
-      std::time_t thisFileTime;
-      size_t currIteration;
-      cerr << term_yellow << "Calling parse from cleanup_backups 2" << term_reset << endl;
-      std::tie(thisFileTime, currIteration) =
-        get_time_and_iteration_from_filename(currName);
+static std::mutex control_mutex;
+static string last_control_result = "none";
 
-      if(keepFileEvaluation(now_as_time_t, thisFileTime, mostRecentIteration, prevIteration, currIteration)){
-        //iterationsSinceKept = 0;
-        prevIteration = currIteration;
-      } else {
-        //++iterationsSinceKept;
-        string full_dir = next_path + "/" + currName;
-        //cerr << "unlinking: " << full_dir << std::endl;
-        unlink(full_dir.c_str());
-      }
+static string control_file_contents() {
+  std::stringstream contents;
+  {
+    std::lock_guard<std::mutex> lock(catalog_mutex);
+    contents << "backed up files: " << backup_catalog.size() << "\n"
+      << "backup bytes: " << total_backup_bytes << "\n";
+  }
+  contents << "snapshot generations: " << snapshot_generation << "\n";
+  contents << "trash generations: " << trash_generation << "\n";
+  contents << "restore: " << (restore_running ? "running" : "idle") << ", "
+    << restore_done << " of " << restore_total << " files done, "
+    << restore_failed << " failed\n";
+  {
+    std::lock_guard<std::mutex> lock(scrub_mutex);
+    contents << "scrubbed backups: " << scrub_checked << "\n"
+      << "corrupt backups: " << scrub_corrupt << "\n";
+    for (const string& backup_path : scrub_corrupt_backups) {
+      contents << "corrupt: " << backup_path << "\n";
     }
+  }
+  {
+    std::lock_guard<std::mutex> lock(control_mutex);
+    contents << "last command: " << last_control_result << "\n";
+  }
+  return contents.str();
+}
 
-  });
+// Runs one command written to the control file
+static int run_control_command(const string& command_line) {
+  std::istringstream command_stream(command_line);
+  string command;
+  command_stream >> command;
+
+  string result;
+  int res = 0;
+  if (command == "snapshot") {
+    string generation = take_snapshot();
+    if (generation.empty()) {
+      result = "snapshot failed";
+      res = -EIO;
+    } else {
+      result = "snapshot " + generation;
+    }
+  } else if (command == "restore") {
+    // restore <path> <time>, where the path may have spaces in it
+    string arguments;
+    std::getline(command_stream, arguments);
+    size_t path_start = arguments.find_first_not_of(' ');
+    size_t time_pos = arguments.find_last_of(' ');
+    std::time_t when;
+    if (path_start == string::npos || time_pos == string::npos
+        || time_pos <= path_start
+        || !parse_time_travel_stamp(arguments.substr(time_pos + 1), &when)) {
+      result = "usage: restore <path> <time>";
+      res = -EINVAL;
+    } else {
+      string path = arguments.substr(path_start, time_pos - path_start);
+      path.erase(path.find_last_not_of(' ') + 1);
+      res = start_restore(path, when);
+      result = res == 0 ? "restoring " + arguments.substr(path_start)
+        : "restore failed: " + string(strerror(-res));
+    }
+  } else if (command == "delete") {
+    // delete <path>, moves the whole tree to the trash at once
+    string path;
+    std::getline(command_stream, path);
+    path.erase(0, path.find_first_not_of(' '));
+    path.erase(path.find_last_not_of(" /") + 1);
+    if (path.size() < 2 || path[0] != '/' || is_read_only_path(path)) {
+      result = "usage: delete <path>";
+      res = -EINVAL;
+    } else {
+      std::shared_lock<std::shared_timed_mutex> snapshot_lock(snapshot_mutex);
+      res = trash_tree(path);
+      result = res == 0 ? "deleted " + path
+        : "delete failed: " + string(strerror(-res));
+    }
+  } else {
+    result = "unknown command " + command;
+    res = -EINVAL;
+  }
 
-//  DIR *dir = opendir(current_directory.c_str());
-//  struct dirent *entry = readdir(dir);
-//  while (entry != nullptr) {
-//    if( parentDir.compare(entry->d_name)  != 0 &&
-//        selfDir.compare(entry->d_name)    != 0){
-//      cerr<< "In cleanup if: " << entry->d_name << std::endl;  
-//      std::vector<string> backups;
-//      string next_path = ((string)current_directory + "/" + (string)entry->d_name);
-//      cerr << "opening path: " << next_path << std::endl;
-//      DIR *dir_backups = opendir(next_path.c_str());
-//      struct dirent *backup = readdir(dir_backups);
-//      cerr<< "Current Backup:" << backup->d_name << std::endl;
-//      while(backup != nullptr){
-//        if( parentDir.compare(backup->d_name) != 0 && //dont want to check .. and .
-//            selfDir.compare(backup->d_name) != 0){
-//          cerr << "Adding to backup list " << backup->d_name << std::endl;
-//          backups.push_back(backup->d_name);
-//        }
-//        backup = readdir(dir_backups);
-//      }
-//      closedir(dir_backups);
-//      //cerr << "after abort test-5" << std::endl;
-//      //alphabetical should make it oldest->newest
-//      std::sort(backups.begin(), backups.end());
-//      //get most recent value against which to compare rest
-//      string mostRecentName;
-//      int mostRecentDate;
-//      int mostRecentIteration;
-//      int iterationsSinceKept = 0;
-//      //cerr << "after abort test-1" << std::endl;
-//      if(!backups.empty()){
-//        mostRecentName = backups.back();
-//        backups.pop_back();
-//        std::string::size_type n = mostRecentName.find( '_' );
-//        mostRecentDate = stoi(mostRecentName.substr(0, n));
-//        //cerr << "date " << mostRecentDate << std::endl;
-//        mostRecentIteration = stoi(mostRecentName.substr(n+1));
-//        //cerr << "iteration " << mostRecentIteration << std::endl;
-//      }
-//      cerr << "after abort test1" << std::endl;
-//      while(!backups.empty()){
-//        string currName = backups.back();
-//        backups.pop_back();
-//        std::string::size_type separator_pos = currName.find( '_' );
-//
-//
-//        std::stringstream time_stringstream;
-//        time_stringstream << currName.substr(0,separator_pos);
-//        std::tm filetime_as_tm;
-//        time_stringstream >> std::get_time(&filetime_as_tm, backup_timestamp_fmt.c_str());
-//        std::time_t filetime_as_time_t = std::mktime(&filetime_as_tm);
-//
-//        size_t currIteration = stoi(currName.substr(separator_pos+1));
-//
-//        std::time_t now_as_time_t = clk::to_time_t(clk::now());
-//
-//        if(keepFileEvaluation(now_as_time_t, filetime_as_time_t, mostRecentIteration, currIteration, iterationsSinceKept)){
-//          iterationsSinceKept = 0;
-//        } else {
-//          ++iterationsSinceKept;
-//          string full_dir = ((string)current_directory + "/" + (string)entry->d_name + "/" + currName);
-//          cerr << "unlinking: " << full_dir << std::endl;
-//          unlink(full_dir.c_str());
-//        }
-//      }
-//      cerr << "after abort test15" << std::endl;
-//    }
-//    entry = readdir(dir);
-//  }
-//  closedir(dir);
-//  return;
+  cerr << term_yellow << "Control: " << result << term_reset << endl;
+  std::lock_guard<std::mutex> lock(control_mutex);
+  last_control_result = result;
+  return res;
 }
 
-//work way down the directory tree
-//everytime it sees a .elephant_snapshot folder, call cleanup
-static void traverse_directory_tree(const string current_directory){
-
-  directory_map(current_directory, [&current_directory](const string& dirname) {
-    string full_path = current_directory + "/" + dirname;
-    struct stat st;
-    lstat(full_path.c_str(), &st);
-    cerr << "just stated: " << full_path << std::endl;
+static int control_getattr(struct stat *stbuf) {
+  memset(stbuf, 0, sizeof(*stbuf));
+  stbuf->st_mode = S_IFREG | 0600;
+  stbuf->st_nlink = 1;
+  stbuf->st_uid = getuid();
+  stbuf->st_gid = getgid();
+  stbuf->st_size = control_file_contents().size();
+  stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime =
+    clk::to_time_t(clk::now());
+  return 0;
+}
 
-    if(S_ISDIR(st.st_mode)){
-      //clean in the snapshot_directory, keep traversing otherwise
-      if(dirname == SNAPSHOT_DIRECTORY_NAME){
-        cleanup_backups(full_path);
-      } else {
-        traverse_directory_tree(full_path);
-      }
-    }
-  });
+static int control_read(char *buf, size_t size, off_t offset) {
+  string contents = control_file_contents();
+  if (offset >= static_cast<off_t>(contents.size())) {
+    return 0;
+  }
+  size_t amount = std::min(size, contents.size() - offset);
+  memcpy(buf, contents.data() + offset, amount);
+  return amount;
 }
 
-static void collectGarbage(){
-  while(true){
-    sleep(GARBAGE_INTERVAL);
-    traverse_directory_tree(mirrordir);
+// Each line of a write is its own command
+static int control_write(const char *buf, size_t size) {
+  std::istringstream lines(string(buf, size));
+  string line;
+  while (std::getline(lines, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    int res = run_control_command(line);
+    if (res != 0) {
+      return res;
+    }
   }
+  return size;
 }
 
 static int xmp_getattr(const char *cpath, struct stat *stbuf)
@@ -481,6 +2950,12 @@ static int xmp_getattr(const char *cpath, struct stat *stbuf)
   int res;
 
   string path(cpath);
+  if (path == "/" + CONTROL_FILE_NAME) {
+    return control_getattr(stbuf);
+  }
+  if (is_time_travel_path(path)) {
+    return time_travel_getattr(path, stbuf);
+  }
   cerr << path << std::endl;
   string mirrorpath = mirrordir + path;
   cerr << mirrorpath << std::endl;
@@ -496,6 +2971,16 @@ static int xmp_access(const char *cpath, int mask)
   int res;
 
   string path(cpath);
+  if (path == "/" + CONTROL_FILE_NAME) {
+    return 0;
+  }
+  if (is_time_travel_path(path)) {
+    if (mask & W_OK) {
+      return -EROFS;
+    }
+    struct stat st;
+    return time_travel_getattr(path, &st);
+  }
   string mirrorpath = mirrordir + path;
   res = access(mirrorpath.c_str(), mask);
   if (res == -1)
@@ -510,6 +2995,15 @@ static int xmp_readlink(const char *cpath, char *buf, size_t size)
 
   string path(cpath);
   string mirrorpath = mirrordir + path;
+  if (is_time_travel_path(path)) {
+    BackupSource source;
+    res = time_travel_resolve(path, &source);
+    if (res != 0)
+      return res;
+    if (source.offset >= 0)
+      return -EINVAL;
+    mirrorpath = source.path;
+  }
   res = readlink(mirrorpath.c_str(), buf, size - 1);
   if (res == -1)
     return -errno;
@@ -519,31 +3013,76 @@ static int xmp_readlink(const char *cpath, char *buf, size_t size)
 }
 
 
+// What's kept in fi->fh between opendir and releasedir
+struct DirectoryHandle {
+  string path;
+  std::shared_ptr<const DirectoryListing> listing;
+  // Set until the first readdir, which doesn't need to list it again
+  bool fresh;
+};
+
+static int list_directory(const string& path,
+                          std::shared_ptr<const DirectoryListing> *listing)
+{
+  if (is_time_travel_path(path)) {
+    auto time_travel = std::make_shared<DirectoryListing>();
+    int res = time_travel_listing(path, time_travel.get());
+    if (res != 0)
+      return res;
+    *listing = time_travel;
+    return 0;
+  }
+  *listing = get_listing(mirrordir + path);
+  if (*listing == nullptr)
+    return -errno;
+  return 0;
+}
+
+static int xmp_opendir(const char *cpath, struct fuse_file_info *fi)
+{
+  std::unique_ptr<DirectoryHandle> handle(new DirectoryHandle);
+  handle->path = cpath;
+  handle->fresh = true;
+  int res = list_directory(handle->path, &handle->listing);
+  if (res != 0)
+    return res;
+
+  fi->fh = reinterpret_cast<uint64_t>(handle.release());
+  return 0;
+}
+
 static int xmp_readdir(const char *cpath, void *buf, fuse_fill_dir_t filler,
                        off_t offset, struct fuse_file_info *fi)
 {
-  DIR *dp;
-  struct dirent *de;
-
-  (void) offset;
-  (void) fi;
+  (void) cpath;
+  DirectoryHandle *handle = reinterpret_cast<DirectoryHandle*>(fi->fh);
 
-  string path(cpath);
-  string mirrorpath = mirrordir + path;
-  dp = opendir(mirrorpath.c_str());
-  if (dp == NULL)
-    return -errno;
+  // Starting over (after a rewinddir) should see what's there now
+  if (offset == 0 && !handle->fresh) {
+    int res = list_directory(handle->path, &handle->listing);
+    if (res != 0)
+      return res;
+  }
+  handle->fresh = false;
 
-  while ((de = readdir(dp)) != NULL) {
+  // Offsets are one past the entry they were handed out with
+  const auto& entries = handle->listing->entries;
+  for (size_t entry = offset; entry < entries.size(); ++entry) {
     struct stat st;
     memset(&st, 0, sizeof(st));
-    st.st_ino = de->d_ino;
-    st.st_mode = de->d_type << 12;
-    if (filler(buf, de->d_name, &st, 0))
+    st.st_ino = entries[entry].ino;
+    st.st_mode = entries[entry].mode;
+    if (filler(buf, entries[entry].name.c_str(), &st, entry + 1))
       break;
   }
 
-  closedir(dp);
+  return 0;
+}
+
+static int xmp_releasedir(const char *cpath, struct fuse_file_info *fi)
+{
+  (void) cpath;
+  delete reinterpret_cast<DirectoryHandle*>(fi->fh);
   return 0;
 }
 
@@ -551,6 +3090,9 @@ static int xmp_mknod(const char *cpath, mode_t mode, dev_t rdev)
 {
   int res;
   string path(cpath);
+  if (is_read_only_path(path))
+    return -EROFS;
+  std::shared_lock<std::shared_timed_mutex> snapshot_lock(snapshot_mutex);
   string mirrorpath = mirrordir + path;
 
   /* On Linux this could just be 'mknod(path, mode, rdev)' but this
@@ -565,6 +3107,7 @@ static int xmp_mknod(const char *cpath, mode_t mode, dev_t rdev)
     res = mknod(mirrorpath.c_str(), mode, rdev);
   if (res == -1)
     return -errno;
+  forget_parent_listing(mirrorpath);
 
   return 0;
 }
@@ -573,11 +3116,15 @@ static int xmp_mkdir(const char *cpath, mode_t mode)
 {
   int res;
   string path(cpath);
+  if (is_read_only_path(path))
+    return -EROFS;
+  std::shared_lock<std::shared_timed_mutex> snapshot_lock(snapshot_mutex);
   string mirrorpath = mirrordir + path;
 
   res = mkdir(mirrorpath.c_str(), mode);
   if (res == -1)
     return -errno;
+  forget_parent_listing(mirrorpath);
 
   return 0;
 }
@@ -588,9 +3135,15 @@ static int xmp_unlink(const char *cpath)
 
 
   string path(cpath);
+  if (is_read_only_path(path))
+    return -EROFS;
+  std::shared_lock<std::shared_timed_mutex> snapshot_lock(snapshot_mutex);
   string mirrorpath = mirrordir + path;
 
-  backupFile(mirrorpath, true);
+  res = backupFile(mirrorpath, true);
+  forget_parent_listing(mirrorpath);
+  if (res != 0)
+    return res;
 
   //res = unlink(mirrorpath.c_str());
   //if (res == -1)
@@ -604,10 +3157,19 @@ static int xmp_rmdir(const char *cpath)
   int res;
 
   string path(cpath);
+  if (is_read_only_path(path))
+    return -EROFS;
+  std::shared_lock<std::shared_timed_mutex> snapshot_lock(snapshot_mutex);
   string mirrorpath = mirrordir + path;
   res = rmdir(mirrorpath.c_str());
-  if (res == -1)
+  if (res == -1) {
+    // All rm -r leaves behind is backups, which go to the trash with it
+    if (errno == ENOTEMPTY && only_backups_left(mirrorpath))
+      return trash_tree(path);
     return -errno;
+  }
+  forget_listing(mirrorpath);
+  forget_parent_listing(mirrorpath);
 
   return 0;
 }
@@ -616,12 +3178,16 @@ static int xmp_symlink(const char *cto, const char *cfrom)
 {
   int res;
   string to(cto), from(cfrom);
+  if (is_read_only_path(from))
+    return -EROFS;
+  std::shared_lock<std::shared_timed_mutex> snapshot_lock(snapshot_mutex);
   string mirrorto = mirrordir + to;
   string mirrorfrom = mirrordir + from;
 
   res = symlink(mirrorto.c_str(), mirrorfrom.c_str());
   if (res == -1)
     return -errno;
+  forget_parent_listing(mirrorfrom);
 
   return 0;
 }
@@ -630,12 +3196,21 @@ static int xmp_rename(const char *cfrom, const char *cto)
 {
   int res;
   string to(cto), from(cfrom);
+  if (is_read_only_path(from) || is_read_only_path(to))
+    return -EROFS;
+  std::shared_lock<std::shared_timed_mutex> snapshot_lock(snapshot_mutex);
   string mirrorto = mirrordir + to;
   string mirrorfrom = mirrordir + from;
 
   res = rename(mirrorfrom.c_str(), mirrorto.c_str());
   if (res == -1)
     return -errno;
+  // A directory takes the backups inside it along
+  struct stat st;
+  if (lstat(mirrorto.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+    catalog_move_tree(mirrorfrom, mirrorto);
+  forget_parent_listing(mirrorfrom);
+  forget_parent_listing(mirrorto);
 
   return 0;
 }
@@ -645,12 +3220,16 @@ static int xmp_link(const char *cfrom, const char *cto)
   int res;
 
   string to(cto), from(cfrom);
+  if (is_read_only_path(from) || is_read_only_path(to))
+    return -EROFS;
+  std::shared_lock<std::shared_timed_mutex> snapshot_lock(snapshot_mutex);
   string mirrorto = mirrordir + to;
   string mirrorfrom = mirrordir + from;
 
   res = link(mirrorfrom.c_str(), mirrorto.c_str());
   if (res == -1)
     return -errno;
+  forget_parent_listing(mirrorto);
 
   return 0;
 }
@@ -660,7 +3239,13 @@ static int xmp_chmod(const char *cpath, mode_t mode)
   int res;
 
   string path(cpath);
+  if (is_read_only_path(path))
+    return -EROFS;
+  std::shared_lock<std::shared_timed_mutex> snapshot_lock(snapshot_mutex);
   string mirrorpath = mirrordir + path;
+  res = preserve_for_snapshots(mirrorpath);
+  if (res != 0)
+    return res;
   res = chmod(mirrorpath.c_str(), mode);
   if (res == -1)
     return -errno;
@@ -673,7 +3258,13 @@ static int xmp_chown(const char *cpath, uid_t uid, gid_t gid)
   int res;
 
   string path(cpath);
+  if (is_read_only_path(path))
+    return -EROFS;
+  std::shared_lock<std::shared_timed_mutex> snapshot_lock(snapshot_mutex);
   string mirrorpath = mirrordir + path;
+  res = preserve_for_snapshots(mirrorpath);
+  if (res != 0)
+    return res;
   res = lchown(mirrorpath.c_str(), uid, gid);
   if (res == -1)
     return -errno;
@@ -686,16 +3277,28 @@ static int xmp_truncate(const char *cpath, off_t size)
   int res;
 
   string path(cpath);
+  if (path == "/" + CONTROL_FILE_NAME) {
+    return 0;
+  }
+  if (is_read_only_path(path))
+    return -EROFS;
+  std::shared_lock<std::shared_timed_mutex> snapshot_lock(snapshot_mutex);
   string mirrorpath = mirrordir + path;
 
   // Common special case, move the old file instead of copying and make a new
   // one
   if (size == 0){
-    backupFile(mirrorpath, true);
+    // Files that keep getting truncated and rewritten would otherwise leave
+    // a backup directory and file each time
+    backupFile(mirrorpath, true, true);
 
     mknod(mirrorpath.c_str(), 0600, 0);
+    forget_parent_listing(mirrorpath);
   } else {
     backupFile(mirrorpath);
+    res = preserve_for_snapshots(mirrorpath);
+    if (res != 0)
+      return res;
   }
 
   res = truncate(mirrorpath.c_str(), size);
@@ -716,7 +3319,16 @@ static int xmp_utimens(const char *cpath, const struct timespec ts[2])
   tv[1].tv_usec = ts[1].tv_nsec / 1000;
 
   string path(cpath);
+  if (path == "/" + CONTROL_FILE_NAME) {
+    return 0;
+  }
+  if (is_read_only_path(path))
+    return -EROFS;
+  std::shared_lock<std::shared_timed_mutex> snapshot_lock(snapshot_mutex);
   string mirrorpath = mirrordir + path;
+  res = preserve_for_snapshots(mirrorpath);
+  if (res != 0)
+    return res;
   res = utimes(mirrorpath.c_str(), tv);
   if (res == -1)
     return -errno;
@@ -729,6 +3341,15 @@ static int xmp_open(const char *cpath, struct fuse_file_info *fi)
   int res;
 
   string path(cpath);
+  if (path == "/" + CONTROL_FILE_NAME) {
+    return 0;
+  }
+  if (is_time_travel_path(path)) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+      return -EROFS;
+    BackupSource source;
+    return time_travel_resolve(path, &source);
+  }
   string mirrorpath = mirrordir + path;
   res = open(mirrorpath.c_str(), fi->flags);
   if (res == -1)
@@ -745,6 +3366,16 @@ static int xmp_read(const char *cpath, char *buf, size_t size, off_t offset,
   int res;
 
   string path(cpath);
+  if (path == "/" + CONTROL_FILE_NAME) {
+    return control_read(buf, size, offset);
+  }
+  if (is_time_travel_path(path)) {
+    BackupSource source;
+    res = time_travel_resolve(path, &source);
+    if (res != 0)
+      return res;
+    return source_read(source, buf, size, offset);
+  }
   string mirrorpath = mirrordir + path;
   (void) fi;
   fd = open(mirrorpath.c_str(), O_RDONLY);
@@ -767,8 +3398,19 @@ static int xmp_write(const char *cpath, const char *buf, size_t size,
 
   (void) fi;
   string path(cpath);
+  if (path == "/" + CONTROL_FILE_NAME) {
+    return control_write(buf, size);
+  }
+  if (is_read_only_path(path))
+    return -EROFS;
+  std::shared_lock<std::shared_timed_mutex> snapshot_lock(snapshot_mutex);
   string mirrorpath = mirrordir + path;
 
+  // Has to happen before opening, since it may replace the file
+  res = preserve_for_snapshots(mirrorpath);
+  if (res != 0)
+    return res;
+
   fd = open(mirrorpath.c_str(), O_WRONLY);
   if (fd == -1)
     return -errno;
@@ -830,7 +3472,9 @@ static struct fuse_operations xmp_oper = {
   .getattr  = xmp_getattr,
   .access    = xmp_access,
   .readlink  = xmp_readlink,
+  .opendir  = xmp_opendir,
   .readdir  = xmp_readdir,
+  .releasedir  = xmp_releasedir,
   .mknod    = xmp_mknod,
   .mkdir    = xmp_mkdir,
   .symlink  = xmp_symlink,
@@ -850,6 +3494,41 @@ static struct fuse_operations xmp_oper = {
   .fsync    = xmp_fsync,
 };
 
+// Parses a plain non-negative number that has to fit in max. Anything else
+// in text, including a sign or trailing garbage, makes it fail
+static bool parse_number(const string& text, long long max, long long& number)
+{
+  char* end;
+  errno = 0;
+  number = strtoll(text.c_str(), &end, 10);
+  return !text.empty() && isdigit(text[0]) && *end == '\0' && errno == 0
+    && number <= max;
+}
+
+// Parses a byte count like 4096, 512K, 20M or 1G
+static bool parse_byte_count(const string& text, off_t& count)
+{
+  string digits = text;
+  int shift = 0;
+  if (!text.empty()) {
+    switch (toupper(text.back())) {
+      case 'T': shift = 40; break;
+      case 'G': shift = 30; break;
+      case 'M': shift = 20; break;
+      case 'K': shift = 10; break;
+    }
+  }
+  if (shift > 0) {
+    digits.pop_back();
+  }
+  long long number;
+  if (!parse_number(digits, LLONG_MAX >> shift, number)) {
+    return false;
+  }
+  count = number << shift;
+  return true;
+}
+
 int main(int argc, char *argv[])
 {
   umask(0);
@@ -861,13 +3540,72 @@ int main(int argc, char *argv[])
 
   char* c_cwd = get_current_dir_name();
   mirrordir = string(c_cwd) + "/" + argv[1];
-  free(c_cwd);
   ++argv;
   --argc;
 
+  // Pull out our own options and pass everything else through to fuse
+  int fuse_argc = 1;
+  for (int i = 1; i < argc; ++i) {
+    string arg(argv[i]);
+    bool valid = true;
+    long long number = 0;
+    if (arg.compare(0, 12, "--cold-tier=") == 0) {
+      coldtierdir = arg.substr(12);
+      if (coldtierdir.empty() || coldtierdir[0] != '/') {
+        coldtierdir = string(c_cwd) + "/" + coldtierdir;
+      }
+    } else if (arg.compare(0, 12, "--trash-age=") == 0) {
+      valid = parse_number(arg.substr(12), INT_MAX, number);
+      TRASH_AGE = number;
+    } else if (arg.compare(0, 11, "--cold-age=") == 0) {
+      valid = parse_number(arg.substr(11), INT_MAX, number);
+      COLD_TIER_AGE = number;
+    } else if (arg.compare(0, 18, "--restore-threads=") == 0) {
+      valid = parse_number(arg.substr(18), INT_MAX, number);
+      RESTORE_THREADS = number;
+    } else if (arg.compare(0, 17, "--pack-threshold=") == 0) {
+      valid = parse_byte_count(arg.substr(17), PACK_THRESHOLD);
+    } else if (arg.compare(0, 16, "--listing-cache=") == 0) {
+      valid = parse_number(arg.substr(16), LLONG_MAX, number);
+      LISTING_CACHE_ENTRIES = number;
+    } else if (arg == "--hide-snapshots") {
+      HIDE_SNAPSHOTS = true;
+    } else if (arg.compare(0, 13, "--scrub-rate=") == 0) {
+      valid = parse_byte_count(arg.substr(13), SCRUB_RATE);
+    } else if (arg.compare(0, 8, "--quota=") == 0) {
+      valid = parse_byte_count(arg.substr(8), BACKUP_QUOTA);
+    } else if (arg.compare(0, 12, "--dir-quota=") == 0) {
+      valid = parse_byte_count(arg.substr(12), DIRECTORY_QUOTA);
+    } else {
+      argv[fuse_argc++] = argv[i];
+    }
+    if (!valid) {
+      cerr << "Bad value in " << arg << ", expected a number of seconds, "
+        << "threads or entries, or a byte count like 512K, 20M or 1G" << endl;
+      return 2;
+    }
+  }
+  argc = fuse_argc;
+  free(c_cwd);
+
   cout << "Opening " << mirrordir << " as backend directory" << endl;
+  if (!coldtierdir.empty()) {
+    cout << "Moving backups older than " << COLD_TIER_AGE << " seconds to "
+      << coldtierdir << endl;
+    makeDirectories(coldtierdir);
+  }
+
+  load_backup_catalog(mirrordir);
+  load_generations();
+  load_trash();
+  cout << "Found backups of " << backup_catalog.size() << " files using "
+    << total_backup_bytes << " bytes" << endl;
+  enforce_quotas("");
 
   std::thread garbage_collection(collectGarbage);
+  if (SCRUB_RATE > 0) {
+    std::thread(scrub_backups).detach();
+  }
   
   return fuse_main(argc, argv, &xmp_oper, NULL);
 }